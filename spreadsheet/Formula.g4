@@ -6,10 +6,14 @@ main
 
 expr
     : '(' expr ')'  # Parens
+    | FUNCTION '(' (expr (',' expr)*)? ')'  # Call
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | expr (LT | LE | GT | GE | EQ | NE) expr  # Compare
+    | CELL ':' CELL  # Range
+    | SHEET? CELL  # Cell
+    | REF  # Ref
     | NUMBER  # Literal
     ;
 
@@ -26,5 +30,20 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference broken by deleting its row or column, as formulas print it
+REF: '#REF!' ;
+// function names have no digits, so they never clash with cell references
+FUNCTION: [A-Z]+ ;
+// sheet prefix of a cross-sheet reference: Sheet2!A1 or 'Sheet 2'!A1
+SHEET
+    : [A-Za-z_] [A-Za-z0-9_]* '!'
+    | '\'' ~['!]+ '\'' '!'
+    ;
 WS: [ \t\n\r]+ -> skip ;
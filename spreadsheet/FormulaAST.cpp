@@ -3,12 +3,22 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "evaluation_limits.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -29,6 +39,7 @@ bool FormulaError::operator==(FormulaError rhs) const {
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -74,13 +85,17 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// Comparisons have the lowest grammatic precedence and are left-associative, so
+// they need parentheses under any arithmetic parent and as a right child of
+// another comparison. Function arguments are printed with EP_ATOM as the parent.
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
 class Expr {
@@ -90,6 +105,30 @@ public:
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate([[maybe_unused]] const SheetInterface& sheet) const = 0;
 
+    // Builds a copy of the expression with constant subtrees folded and
+    // identity operations removed. Sets `changed` if anything was simplified.
+    // Subtrees that would fail at evaluation (e.g. 1/0) are kept as is, so the
+    // error is still reported by Evaluate.
+    virtual std::unique_ptr<Expr> Optimize(bool& changed) const = 0;
+
+    // Appends the expression to a column kernel, with cell references made
+    // relative to the row of `origin`. Returns false if the expression can't
+    // be evaluated by a kernel.
+    virtual bool CompileColumnKernel(ColumnKernel& kernel, Position origin) const = 0;
+
+    // Heap memory taken by the node and its subtree, in bytes
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Value of the expression if it doesn't depend on cells
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+
+    // Visits the slots holding the node's children, so that a tree can be
+    // rewritten in place
+    virtual void ForEachChild(const std::function<void(std::unique_ptr<Expr>&)>& /* visit */) {
+    }
+
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
@@ -111,6 +150,71 @@ public:
 };
 
 namespace {
+// Value of a cell as a number: empty cells are 0, text gives #VALUE!, errors
+// propagate
+double GetCellNumber(const CellInterface* cell) {
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    auto value = cell->GetValue();
+    double result;
+    if (std::holds_alternative<std::string>(value)){
+        throw FormulaError(FormulaError::Category::Value);
+    } else if (std::holds_alternative<FormulaError>(value)){
+        throw std::get<FormulaError>(value);
+    } else if (std::holds_alternative<double>(value)){
+        result = std::get<double>(value);
+    }
+    return result;
+}
+
+double GetCellNumber(const SheetInterface& sheet, Position pos) {
+    return GetCellNumber(sheet.GetCell(pos));
+}
+
+class NumberExpr final : public Expr {
+public:
+    explicit NumberExpr(double value)
+        : value_(value) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << value_;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << value_;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        return value_;
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    bool CompileColumnKernel(ColumnKernel& kernel, Position /* origin */) const override {
+        kernel.ops.push_back({ColumnKernel::OpCode::PushConst, value_});
+        return true;
+    }
+
+    std::optional<double> GetConstant() const override {
+        return value_;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+private:
+    double value_;
+};
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -159,10 +263,74 @@ public:
     }
 
     double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
-        double result;
         double l_value = lhs_->Evaluate(sheet);
         double r_value = rhs_->Evaluate(sheet);
-        switch (type_)
+        return Apply(type_, l_value, r_value);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        auto lhs = lhs_->Optimize(changed);
+        auto rhs = rhs_->Optimize(changed);
+        auto l_const = lhs->GetConstant();
+        auto r_const = rhs->GetConstant();
+        if (l_const && r_const) {
+            try {
+                double value = Apply(type_, *l_const, *r_const);
+                changed = true;
+                return std::make_unique<NumberExpr>(value);
+            } catch (const FormulaError&) {
+                // keep the node: the error must surface on every evaluation
+            }
+        }
+        // x+0 and 0+x are not simplified: -0+0 yields +0, which is printed differently
+        bool right_identity = r_const
+            && (((type_ == Multiply || type_ == Divide) && *r_const == 1.0)
+                || (type_ == Subtract && *r_const == 0.0 && !std::signbit(*r_const)));
+        if (right_identity) {
+            changed = true;
+            return lhs;
+        }
+        if (l_const && type_ == Multiply && *l_const == 1.0) {
+            changed = true;
+            return rhs;
+        }
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    bool CompileColumnKernel(ColumnKernel& kernel, Position origin) const override {
+        if (!lhs_->CompileColumnKernel(kernel, origin) || !rhs_->CompileColumnKernel(kernel, origin)) {
+            return false;
+        }
+        switch (type_) {
+            case Add:
+                kernel.ops.push_back({ColumnKernel::OpCode::Add});
+                break;
+            case Subtract:
+                kernel.ops.push_back({ColumnKernel::OpCode::Subtract});
+                break;
+            case Multiply:
+                kernel.ops.push_back({ColumnKernel::OpCode::Multiply});
+                break;
+            case Divide:
+                kernel.ops.push_back({ColumnKernel::OpCode::Divide});
+                break;
+        }
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    void ForEachChild(const std::function<void(std::unique_ptr<Expr>&)>& visit) override {
+        visit(lhs_);
+        visit(rhs_);
+    }
+
+private:
+    static double Apply(Type type, double l_value, double r_value) {
+        double result;
+        switch (type)
         {
         case Type::Add:
             result = l_value + r_value;
@@ -186,7 +354,6 @@ public:
         return result;
     }
 
-private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
@@ -233,6 +400,37 @@ public:
         return result;
     }
 
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        auto operand = operand_->Optimize(changed);
+        if (auto value = operand->GetConstant()) {
+            changed = true;
+            return std::make_unique<NumberExpr>(type_ == UnaryMinus ? -*value : *value);
+        }
+        if (type_ == UnaryPlus) {
+            changed = true;
+            return operand;
+        }
+        return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+    }
+
+    bool CompileColumnKernel(ColumnKernel& kernel, Position origin) const override {
+        if (!operand_->CompileColumnKernel(kernel, origin)) {
+            return false;
+        }
+        if (type_ == UnaryMinus) {
+            kernel.ops.push_back({ColumnKernel::OpCode::Negate});
+        }
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
+    void ForEachChild(const std::function<void(std::unique_ptr<Expr>&)>& visit) override {
+        visit(operand_);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -240,13 +438,17 @@ private:
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    // sheet is null for references to the formula's own sheet
+    explicit CellExpr(const Position* cell, const std::string* sheet = nullptr)
+        : cell_(cell)
+        , sheet_(sheet) {
     }
 
     void Print(std::ostream& out) const override {
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
+        } else if (sheet_ != nullptr) {
+            out << SheetPosition{*sheet_, *cell_}.ToString();
         } else {
             out << cell_->ToString();
         }
@@ -264,38 +466,65 @@ public:
         if (!cell_->IsValid()){
             throw FormulaError(FormulaError::Category::Ref);
         }
-        auto cell = sheet.GetCell(*cell_);
-        if (cell == nullptr) {
-            return 0.0;
+        const SheetInterface* target = &sheet;
+        if (sheet_ != nullptr) {
+            target = sheet.FindSheet(*sheet_);
+            if (target == nullptr) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
         }
-        auto value = cell->GetValue();
-        double result;
-        if (std::holds_alternative<std::string>(value)){
-            throw FormulaError(FormulaError::Category::Value);
-        } else if (std::holds_alternative<FormulaError>(value)){
-            throw value;
-        } else if (std::holds_alternative<double>(value)){
-            result = std::get<double>(value);
+        return GetCellNumber(*target, *cell_);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<CellExpr>(cell_, sheet_);
+    }
+
+    bool CompileColumnKernel(ColumnKernel& kernel, Position origin) const override {
+        if (!cell_->IsValid() || sheet_ != nullptr) {
+            return false;
         }
-        return result;
+        kernel.ops.push_back({ColumnKernel::OpCode::PushRef, 0.0, cell_->row - origin.row, cell_->col});
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    // A valid reference to the formula's own sheet
+    bool IsLocal() const {
+        return cell_->IsValid() && sheet_ == nullptr;
+    }
+
+    // A reference broken by a deletion (printed and parsed as #REF!)
+    bool IsBroken() const {
+        return !cell_->IsValid();
     }
 
 private:
     const Position* cell_;
+    const std::string* sheet_;
 };
 
-class NumberExpr final : public Expr {
+// A range is only meaningful as an argument of a function that takes one;
+// anywhere else it evaluates to #VALUE!
+class RangeExpr final : public Expr {
 public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    explicit RangeExpr(const CellRange* range)
+        : range_(range) {
     }
 
     void Print(std::ostream& out) const override {
-        out << value_;
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->ToString();
+        }
     }
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+        Print(out);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -303,13 +532,750 @@ public:
     }
 
     double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
-        return value_;
+        GetRange();
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<RangeExpr>(range_);
+    }
+
+    bool CompileColumnKernel(ColumnKernel& /* kernel */, Position /* origin */) const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    // Throws #REF! if a deletion broke the range
+    const CellRange& GetRange() const {
+        if (!range_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *range_;
     }
 
 private:
-    double value_;
+    const CellRange* range_;
+};
+
+class CompareExpr final : public Expr {
+public:
+    enum Type : char {
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+        Equal,
+        NotEqual,
+    };
+
+    explicit CompareExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetOperator() << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << GetOperator();
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_CMP;
+    }
+
+    // true and false are 1 and 0
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        double l_value = lhs_->Evaluate(sheet);
+        double r_value = rhs_->Evaluate(sheet);
+        return Apply(type_, l_value, r_value);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        auto lhs = lhs_->Optimize(changed);
+        auto rhs = rhs_->Optimize(changed);
+        auto l_const = lhs->GetConstant();
+        auto r_const = rhs->GetConstant();
+        if (l_const && r_const) {
+            changed = true;
+            return std::make_unique<NumberExpr>(Apply(type_, *l_const, *r_const));
+        }
+        return std::make_unique<CompareExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    bool CompileColumnKernel(ColumnKernel& /* kernel */, Position /* origin */) const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    void ForEachChild(const std::function<void(std::unique_ptr<Expr>&)>& visit) override {
+        visit(lhs_);
+        visit(rhs_);
+    }
+
+private:
+    static double Apply(Type type, double l_value, double r_value) {
+        switch (type) {
+            case Less:
+                return l_value < r_value;
+            case LessOrEqual:
+                return l_value <= r_value;
+            case Greater:
+                return l_value > r_value;
+            case GreaterOrEqual:
+                return l_value >= r_value;
+            case Equal:
+                return l_value == r_value;
+            case NotEqual:
+                return l_value != r_value;
+        }
+        assert(false);
+        return 0.0;
+    }
+
+    const char* GetOperator() const {
+        static const char* const OPERATORS[] = {"<", "<=", ">", ">=", "=", "<>"};
+        return OPERATORS[type_];
+    }
+
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+};
+
+// Built-in functions.
+//
+// A kernel is a stateless struct with static Apply overloads, one per
+// supported arity. FunctionExpr is instantiated for each kernel and arity, so
+// the function is resolved once at parse time and its body is inlined into
+// Evaluate: there is no name lookup and no extra virtual call per evaluation.
+
+struct AbsKernel {
+    static double Apply(double value) {
+        return std::abs(value);
+    }
+};
+
+struct RoundKernel {
+    // Halves are rounded away from zero
+    static double Apply(double value) {
+        return std::round(value);
+    }
+
+    // Negative digits round to tens, hundreds, ...
+    static double Apply(double value, double digits) {
+        double factor = std::pow(10.0, std::trunc(digits));
+        if (factor == 0.0) {
+            return 0.0;
+        }
+        if (!std::isfinite(value * factor)) {
+            return value;  // more digits than a double holds
+        }
+        return std::round(value * factor) / factor;
+    }
+};
+
+struct MinKernel {
+    static double Apply(double value) {
+        return value;
+    }
+
+    static double Apply(double lhs, double rhs) {
+        return std::min(lhs, rhs);
+    }
+};
+
+struct MaxKernel {
+    static double Apply(double value) {
+        return value;
+    }
+
+    static double Apply(double lhs, double rhs) {
+        return std::max(lhs, rhs);
+    }
+};
+
+// Shared part of function call nodes: printing and argument storage
+template <typename Args>
+class CallExpr : public Expr {
+public:
+    CallExpr(const char* name, Args args)
+        : name_(name)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << name_;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << name_ << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    bool CompileColumnKernel(ColumnKernel& /* kernel */, Position /* origin */) const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t usage = sizeof(*this);
+        for (const auto& arg : args_) {
+            usage += arg->GetMemoryUsage();
+        }
+        if constexpr (std::is_same_v<Args, std::vector<std::unique_ptr<Expr>>>) {
+            usage += args_.capacity() * sizeof(std::unique_ptr<Expr>);
+        }
+        return usage;
+    }
+
+    void ForEachChild(const std::function<void(std::unique_ptr<Expr>&)>& visit) override {
+        for (auto& arg : args_) {
+            visit(arg);
+        }
+    }
+
+protected:
+    static double CheckResult(double result) {
+        if (!std::isfinite(result)) {
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+        return result;
+    }
+
+    // Optimized copies of the arguments; `all_constant` tells whether the
+    // call can be folded
+    Args OptimizeArgs(bool& changed, bool& all_constant) const {
+        Args args;
+        if constexpr (std::is_same_v<Args, std::vector<std::unique_ptr<Expr>>>) {
+            args.resize(args_.size());
+        }
+        all_constant = true;
+        for (size_t i = 0; i < args_.size(); ++i) {
+            args[i] = args_[i]->Optimize(changed);
+            all_constant = all_constant && args[i]->GetConstant().has_value();
+        }
+        return args;
+    }
+
+    const char* name_;
+    Args args_;
+};
+
+template <typename Kernel, size_t N>
+class FunctionExpr final : public CallExpr<std::array<std::unique_ptr<Expr>, N>> {
+    using Base = CallExpr<std::array<std::unique_ptr<Expr>, N>>;
+
+public:
+    using Base::Base;
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        std::array<double, N> values;
+        for (size_t i = 0; i < N; ++i) {
+            values[i] = this->args_[i]->Evaluate(sheet);
+        }
+        return Base::CheckResult(Call(values, std::make_index_sequence<N>{}));
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        bool all_constant;
+        auto args = Base::OptimizeArgs(changed, all_constant);
+        if (all_constant) {
+            std::array<double, N> values;
+            for (size_t i = 0; i < N; ++i) {
+                values[i] = *args[i]->GetConstant();
+            }
+            try {
+                double value = Base::CheckResult(Call(values, std::make_index_sequence<N>{}));
+                changed = true;
+                return std::make_unique<NumberExpr>(value);
+            } catch (const FormulaError&) {
+                // keep the node: the error must surface on every evaluation
+            }
+        }
+        return std::make_unique<FunctionExpr>(this->name_, std::move(args));
+    }
+
+private:
+    template <size_t... I>
+    static double Call(const std::array<double, N>& values, std::index_sequence<I...>) {
+        return Kernel::Apply(values[I]...);
+    }
 };
 
+// Calls with more arguments than the fixed-arity instantiations cover; the
+// kernel's binary Apply is folded over the arguments
+template <typename Kernel>
+class FoldExpr final : public CallExpr<std::vector<std::unique_ptr<Expr>>> {
+    using Base = CallExpr<std::vector<std::unique_ptr<Expr>>>;
+
+public:
+    using Base::Base;
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        double result = args_.front()->Evaluate(sheet);
+        for (size_t i = 1; i < args_.size(); ++i) {
+            result = Kernel::Apply(result, args_[i]->Evaluate(sheet));
+        }
+        return CheckResult(result);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        bool all_constant;
+        auto args = OptimizeArgs(changed, all_constant);
+        if (all_constant) {
+            double result = *args.front()->GetConstant();
+            for (size_t i = 1; i < args.size(); ++i) {
+                result = Kernel::Apply(result, *args[i]->GetConstant());
+            }
+            if (std::isfinite(result)) {
+                changed = true;
+                return std::make_unique<NumberExpr>(result);
+            }
+        }
+        return std::make_unique<FoldExpr>(name_, std::move(args));
+    }
+};
+
+// IF(condition, then[, else]): only the taken branch is evaluated, so cells
+// referenced by the other branch are not computed. A missing else gives 0.
+class IfExpr final : public CallExpr<std::vector<std::unique_ptr<Expr>>> {
+    using Base = CallExpr<std::vector<std::unique_ptr<Expr>>>;
+
+public:
+    using Base::Base;
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        if (args_[0]->Evaluate(sheet) != 0.0) {
+            return args_[1]->Evaluate(sheet);
+        }
+        return args_.size() > 2 ? args_[2]->Evaluate(sheet) : 0.0;
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        auto condition = args_[0]->Optimize(changed);
+        if (auto value = condition->GetConstant()) {
+            changed = true;
+            if (*value != 0.0) {
+                return args_[1]->Optimize(changed);
+            }
+            return args_.size() > 2 ? args_[2]->Optimize(changed) : std::make_unique<NumberExpr>(0.0);
+        }
+        std::vector<std::unique_ptr<Expr>> args;
+        args.push_back(std::move(condition));
+        for (size_t i = 1; i < args_.size(); ++i) {
+            args.push_back(args_[i]->Optimize(changed));
+        }
+        return std::make_unique<IfExpr>(name_, std::move(args));
+    }
+};
+
+using Arguments = std::vector<std::unique_ptr<Expr>>;
+
+// Lookup functions. The search itself is delegated to
+// SheetInterface::FindInColumn, so a sheet with column indexes answers it
+// without scanning the range. Only numeric keys are supported; a key that is
+// not found gives #VALUE!.
+class LookupExpr : public CallExpr<std::vector<std::unique_ptr<Expr>>> {
+    using Base = CallExpr<std::vector<std::unique_ptr<Expr>>>;
+
+public:
+    using Base::Base;
+
+protected:
+    // The factory has checked that the argument is a range or a broken
+    // reference; the latter throws #REF!
+    const CellRange& GetRangeArgument(size_t index) const {
+        auto range = dynamic_cast<const RangeExpr*>(args_[index].get());
+        if (range == nullptr) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return range->GetRange();
+    }
+
+    // Row of `key` in the only column of `range`
+    static std::optional<int> Find(const SheetInterface& sheet, const CellRange& range, double key,
+                                   bool exact) {
+        if (range.first.col != range.last.col) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return sheet.FindInColumn(range.first.col, range.first.row, range.last.row, key, exact);
+    }
+
+    Arguments OptimizeArguments(bool& changed) const {
+        bool all_constant;
+        return OptimizeArgs(changed, all_constant);
+    }
+};
+
+// MATCH(key, column[, type]): 1-based position of the key in the column.
+// Type 1 (default) finds the largest value not greater than the key in a
+// column sorted ascending, type 0 finds an exact match.
+class MatchExpr final : public LookupExpr {
+public:
+    using LookupExpr::LookupExpr;
+
+    static constexpr std::array<size_t, 1> RANGE_ARGUMENTS = {1};
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        double key = args_[0]->Evaluate(sheet);
+        const CellRange& range = GetRangeArgument(1);
+        double type = args_.size() > 2 ? args_[2]->Evaluate(sheet) : 1.0;
+        if (type != 0.0 && type != 1.0) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        auto row = Find(sheet, range, key, type == 0.0);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return *row - range.first.row + 1;
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        return std::make_unique<MatchExpr>(name_, OptimizeArguments(changed));
+    }
+};
+
+// VLOOKUP(key, table, column[, approximate]): value from the given 1-based
+// column of the table row whose first cell matches the key. The match is
+// approximate (as in MATCH type 1) unless the last argument is 0.
+class VLookupExpr final : public LookupExpr {
+public:
+    using LookupExpr::LookupExpr;
+
+    static constexpr std::array<size_t, 1> RANGE_ARGUMENTS = {1};
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        double key = args_[0]->Evaluate(sheet);
+        const CellRange& table = GetRangeArgument(1);
+        double column = std::trunc(args_[2]->Evaluate(sheet));
+        if (column < 1.0 || column > table.last.col - table.first.col + 1) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        bool exact = args_.size() > 3 && args_[3]->Evaluate(sheet) == 0.0;
+        CellRange keys{table.first, {table.last.row, table.first.col}};
+        auto row = Find(sheet, keys, key, exact);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return GetCellNumber(sheet, {*row, table.first.col + static_cast<int>(column) - 1});
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        return std::make_unique<VLookupExpr>(name_, OptimizeArguments(changed));
+    }
+};
+
+// XLOOKUP(key, keys, results[, if_not_found]): value from the results column
+// in the row where the keys column holds exactly the key. The fallback is
+// evaluated only when the key is missing.
+class XLookupExpr final : public LookupExpr {
+public:
+    using LookupExpr::LookupExpr;
+
+    static constexpr std::array<size_t, 2> RANGE_ARGUMENTS = {1, 2};
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        double key = args_[0]->Evaluate(sheet);
+        const CellRange& keys = GetRangeArgument(1);
+        const CellRange& results = GetRangeArgument(2);
+        if (results.first.col != results.last.col
+            || results.last.row - results.first.row != keys.last.row - keys.first.row) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        auto row = Find(sheet, keys, key, /* exact = */ true);
+        if (!row) {
+            if (args_.size() > 3) {
+                return args_[3]->Evaluate(sheet);
+            }
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return GetCellNumber(sheet, {results.first.row + *row - keys.first.row, results.first.col});
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        return std::make_unique<XLookupExpr>(name_, OptimizeArguments(changed));
+    }
+};
+
+// SUM, COUNT, AVERAGE, and MIN/MAX over ranges. Arguments are ranges or
+// plain expressions; a range is summarised by SheetInterface::AggregateRange,
+// which a sheet answers from per-column aggregates without visiting the
+// cells. As in other spreadsheets, empty and text cells inside ranges are
+// skipped, and COUNT ignores errors inside ranges.
+class AggregateExpr final : public CallExpr<std::vector<std::unique_ptr<Expr>>> {
+    using Base = CallExpr<std::vector<std::unique_ptr<Expr>>>;
+
+public:
+    enum Type : char {
+        Sum,
+        Count,
+        Average,
+        Min,
+        Max,
+    };
+
+    AggregateExpr(Type type, const char* name, Arguments args)
+        : Base(name, std::move(args))
+        , type_(type) {
+    }
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        RangeSummary total;
+        for (const auto& arg : args_) {
+            if (auto range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                RangeSummary summary = sheet.AggregateRange(range->GetRange());
+                if (summary.error && type_ != Count) {
+                    throw *summary.error;
+                }
+                total.sum += summary.sum;
+                total.count += summary.count;
+                total.min = std::min(total.min, summary.min);
+                total.max = std::max(total.max, summary.max);
+            } else {
+                double value = arg->Evaluate(sheet);
+                total.sum += value;
+                ++total.count;
+                total.min = std::min(total.min, value);
+                total.max = std::max(total.max, value);
+            }
+        }
+        switch (type_) {
+            case Sum:
+                return CheckResult(total.sum);
+            case Count:
+                return static_cast<double>(total.count);
+            case Average:
+                if (total.count == 0) {
+                    throw FormulaError(FormulaError::Category::Arithmetic);
+                }
+                return CheckResult(total.sum / total.count);
+            case Min:
+                return total.count == 0 ? 0.0 : total.min;
+            case Max:
+                return total.count == 0 ? 0.0 : total.max;
+        }
+        assert(false);
+        return 0.0;
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        bool all_constant;
+        return std::make_unique<AggregateExpr>(type_, name_, OptimizeArgs(changed, all_constant));
+    }
+
+private:
+    Type type_;
+};
+
+template <typename Kernel, size_t N>
+std::unique_ptr<Expr> MakeFixedCall(const char* name, Arguments& args) {
+    std::array<std::unique_ptr<Expr>, N> fixed;
+    std::move(args.begin(), args.end(), fixed.begin());
+    return std::make_unique<FunctionExpr<Kernel, N>>(name, std::move(fixed));
+}
+
+// Whether Kernel::Apply accepts N arguments
+template <typename Kernel, size_t N, typename = void>
+struct HasArity : std::false_type {};
+template <typename Kernel>
+struct HasArity<Kernel, 1, std::void_t<decltype(Kernel::Apply(0.0))>> : std::true_type {};
+template <typename Kernel>
+struct HasArity<Kernel, 2, std::void_t<decltype(Kernel::Apply(0.0, 0.0))>> : std::true_type {};
+
+// The argument count has already been checked against the registry entry
+template <typename Kernel>
+std::unique_ptr<Expr> MakeCall(const char* name, Arguments& args) {
+    if constexpr (HasArity<Kernel, 1>::value) {
+        if (args.size() == 1) {
+            return MakeFixedCall<Kernel, 1>(name, args);
+        }
+    }
+    if constexpr (HasArity<Kernel, 2>::value) {
+        if (args.size() == 2) {
+            return MakeFixedCall<Kernel, 2>(name, args);
+        }
+        return std::make_unique<FoldExpr<Kernel>>(name, std::move(args));
+    }
+    throw ParsingError(std::string("Wrong number of arguments for ") + name);
+}
+
+std::unique_ptr<Expr> MakeIf(const char* name, Arguments& args) {
+    return std::make_unique<IfExpr>(name, std::move(args));
+}
+
+template <AggregateExpr::Type type>
+std::unique_ptr<Expr> MakeAggregate(const char* name, Arguments& args) {
+    return std::make_unique<AggregateExpr>(type, name, std::move(args));
+}
+
+// MIN and MAX keep the scalar kernels unless a range is passed
+template <typename Kernel, AggregateExpr::Type type>
+std::unique_ptr<Expr> MakeMinMax(const char* name, Arguments& args) {
+    bool has_range = std::any_of(args.begin(), args.end(), [](const std::unique_ptr<Expr>& arg) {
+        return dynamic_cast<const RangeExpr*>(arg.get()) != nullptr;
+    });
+    if (has_range) {
+        return MakeAggregate<type>(name, args);
+    }
+    return MakeCall<Kernel>(name, args);
+}
+
+template <typename Lookup>
+std::unique_ptr<Expr> MakeLookup(const char* name, Arguments& args) {
+    for (size_t index : Lookup::RANGE_ARGUMENTS) {
+        // A range broken by a deletion reads back as #REF!
+        auto cell = dynamic_cast<const CellExpr*>(args[index].get());
+        if (dynamic_cast<const RangeExpr*>(args[index].get()) == nullptr
+            && (cell == nullptr || !cell->IsBroken())) {
+            throw ParsingError(std::string("Expected a range in ") + name);
+        }
+    }
+    return std::make_unique<Lookup>(name, std::move(args));
+}
+
+struct FunctionEntry {
+    const char* name;
+    size_t min_args;
+    size_t max_args;
+    std::unique_ptr<Expr> (*make)(const char* name, Arguments& args);
+};
+
+const FunctionEntry FUNCTIONS[] = {
+    {"ABS", 1, 1, MakeCall<AbsKernel>},
+    {"ROUND", 1, 2, MakeCall<RoundKernel>},
+    {"MIN", 1, SIZE_MAX, MakeMinMax<MinKernel, AggregateExpr::Min>},
+    {"MAX", 1, SIZE_MAX, MakeMinMax<MaxKernel, AggregateExpr::Max>},
+    {"SUM", 1, SIZE_MAX, MakeAggregate<AggregateExpr::Sum>},
+    {"COUNT", 1, SIZE_MAX, MakeAggregate<AggregateExpr::Count>},
+    {"AVERAGE", 1, SIZE_MAX, MakeAggregate<AggregateExpr::Average>},
+    {"IF", 2, 3, MakeIf},
+    {"MATCH", 2, 3, MakeLookup<MatchExpr>},
+    {"VLOOKUP", 3, 4, MakeLookup<VLookupExpr>},
+    {"XLOOKUP", 3, 4, MakeLookup<XLookupExpr>},
+};
+
+// A subexpression shared by several formulas of a sheet. It is computed once
+// by a hidden cell, which caches the value like any formula cell (see
+// Sheet::ShareCommonSubexpressions). Such nodes appear only in evaluation
+// trees; the original subtree is kept for printing and unsharing.
+class SharedExpr final : public Expr {
+public:
+    SharedExpr(const CellInterface* cell, std::unique_ptr<Expr> expr)
+        : cell_(cell)
+        , expr_(std::move(expr)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        expr_->Print(out);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        expr_->DoPrintFormula(out, precedence);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return expr_->GetPrecedence();
+    }
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+        return GetCellNumber(cell_);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        return expr_->Optimize(changed);
+    }
+
+    bool CompileColumnKernel(ColumnKernel& /* kernel */, Position /* origin */) const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + expr_->GetMemoryUsage();
+    }
+
+private:
+    const CellInterface* cell_;
+    std::unique_ptr<Expr> expr_;
+};
+
+// Canonical text of a subtree: formula syntax with numbers printed exactly,
+// so that parsing the text gives back the same expression
+std::string GetSubexpressionText(const Expr& expr) {
+    std::ostringstream out;
+    out.precision(std::numeric_limits<double>::max_digits10);
+    expr.PrintFormula(out, EP_ATOM);
+    return out.str();
+}
+
+// Calls `visit` for every subtree that a hidden cell of the same sheet could
+// compute: an operation or call whose references are all valid cells of the
+// formula's own sheet, with no ranges. Returns whether `expr` itself
+// qualifies, leaves included.
+bool CollectSubexpressions(Expr& expr, const std::function<void(Expr&)>& visit) {
+    if (auto cell = dynamic_cast<const CellExpr*>(&expr)) {
+        return cell->IsLocal();
+    }
+    if (dynamic_cast<const RangeExpr*>(&expr) != nullptr) {
+        return false;
+    }
+    bool local = true;
+    bool leaf = true;
+    expr.ForEachChild([&](std::unique_ptr<Expr>& child) {
+        leaf = false;
+        local = CollectSubexpressions(*child, visit) && local;
+    });
+    if (local && !leaf) {
+        visit(expr);
+    }
+    return local;
+}
+
+// Replaces the outermost subtrees for which `lookup` gives a cell
+void ReplaceSubexpressions(std::unique_ptr<Expr>& slot,
+                           const std::unordered_map<const Expr*, std::string>& texts,
+                           const std::function<const CellInterface*(const std::string&)>& lookup) {
+    if (auto it = texts.find(slot.get()); it != texts.end()) {
+        if (const CellInterface* cell = lookup(it->second)) {
+            slot = std::make_unique<SharedExpr>(cell, std::move(slot));
+            return;
+        }
+    }
+    slot->ForEachChild([&](std::unique_ptr<Expr>& child) {
+        ReplaceSubexpressions(child, texts, lookup);
+    });
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -324,6 +1290,14 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<SheetPosition> MoveExternalCells() {
+        return std::move(external_cells_);
+    }
+
+    std::forward_list<CellRange> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -363,11 +1337,44 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
+        if (ctx->SHEET() != nullptr) {
+            // strip the trailing '!' and the optional quotes
+            auto sheet = ctx->SHEET()->getSymbol()->getText();
+            sheet.pop_back();
+            if (sheet.front() == '\'') {
+                sheet = sheet.substr(1, sheet.size() - 2);
+            }
+            external_cells_.push_front({std::move(sheet), value});
+            auto& ref = external_cells_.front();
+            args_.push_back(std::make_unique<CellExpr>(&ref.pos, &ref.sheet));
+            return;
+        }
+
         cells_.push_front(value);
         auto node = std::make_unique<CellExpr>(&cells_.front());
         args_.push_back(std::move(node));
     }
 
+    void exitRef(FormulaParser::RefContext* /* ctx */) override {
+        cells_.push_front(Position::NONE);
+        args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        auto last_str = ctx->CELL(1)->getSymbol()->getText();
+        auto first = Position::FromString(first_str);
+        auto last = Position::FromString(last_str);
+        if (!first.IsValid() || !last.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ':' + last_str);
+        }
+
+        // B5:A1 is the same range as A1:B5
+        ranges_.push_front({{std::min(first.row, last.row), std::min(first.col, last.col)},
+                            {std::max(first.row, last.row), std::max(first.col, last.col)}});
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
@@ -392,6 +1399,54 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitCompare(FormulaParser::CompareContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        CompareExpr::Type type;
+        if (ctx->LT()) {
+            type = CompareExpr::Less;
+        } else if (ctx->LE()) {
+            type = CompareExpr::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = CompareExpr::Greater;
+        } else if (ctx->GE()) {
+            type = CompareExpr::GreaterOrEqual;
+        } else if (ctx->EQ()) {
+            type = CompareExpr::Equal;
+        } else {
+            assert(ctx->NE() != nullptr);
+            type = CompareExpr::NotEqual;
+        }
+
+        auto node = std::make_unique<CompareExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        auto name = ctx->FUNCTION()->getSymbol()->getText();
+        size_t arg_count = ctx->expr().size();
+        assert(args_.size() >= arg_count);
+
+        auto entry = std::find_if(std::begin(FUNCTIONS), std::end(FUNCTIONS),
+                                  [&name](const FunctionEntry& entry) { return name == entry.name; });
+        if (entry == std::end(FUNCTIONS)) {
+            throw ParsingError("Unknown function: " + name);
+        }
+        if (arg_count < entry->min_args || arg_count > entry->max_args) {
+            throw ParsingError("Wrong number of arguments for " + name);
+        }
+
+        Arguments args(std::make_move_iterator(args_.end() - arg_count),
+                       std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - arg_count);
+        args_.push_back(entry->make(entry->name, args));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
@@ -399,6 +1454,8 @@ public:
 private:
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetPosition> external_cells_;
+    std::forward_list<CellRange> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -411,36 +1468,62 @@ public:
     }
 };
 
-}  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+// Lexer, token stream and parser of one thread. They are built once and
+// re-pointed at each new input instead of being rebuilt per formula; the
+// parser's reset also releases the previous parse tree. A failed parse leaves
+// no state behind, since every Parse starts with a full reset.
+class ParserContext {
+public:
+    ParserContext()
+        : lexer_(&input_)
+        , tokens_(&lexer_)
+        , parser_(&tokens_) {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser_.removeErrorListeners();
+    }
 
-    ANTLRInputStream input(in);
+    ParserContext(const ParserContext&) = delete;
+    ParserContext& operator=(const ParserContext&) = delete;
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    antlr4::tree::ParseTree* Parse(const std::string& text) {
+        input_.load(text, false);
+        lexer_.setInputStream(&input_);
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+        return parser_.main();
+    }
 
-    CommonTokenStream tokens(&lexer);
+    static ParserContext& ForThread() {
+        thread_local ParserContext context;
+        return context;
+    }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+private:
+    antlr4::ANTLRInputStream input_;
+    BailErrorListener error_listener_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+};
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+}  // namespace
+}  // namespace ASTImpl
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in) {
+    return ParseFormulaAST(std::string(std::istreambuf_iterator<char>(in), {}));
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    Trace::TraceSpan span("ParseFormulaAST");
+
+    antlr4::tree::ParseTree* tree = ASTImpl::ParserContext::ForThread().Parse(in_str);
+    ASTImpl::ParseASTListener listener;
+    antlr4::tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(),
+                      listener.MoveRanges());
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -458,23 +1541,205 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
 }
 
 double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    CheckEvaluationLimits();
+    return GetEvalExpr().Evaluate(sheet);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<SheetPosition> external_cells,
+                       std::forward_list<CellRange> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort(); // to avoid sorting in GetReferencedCells
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells))
+    , ranges_(std::move(ranges)) {
+    cells_.sort();
+    external_cells_.sort();
+    ranges_.sort();
+    UpdateReferenceLists();
+    BuildEvalTree();
+}
+
+void FormulaAST::BuildEvalTree() const {
+    bool changed = false;
+    auto optimized = root_expr_->Optimize(changed);
+    eval_expr_ = changed ? std::move(optimized) : nullptr;
+    eval_expr_released_ = false;
+}
+
+const ASTImpl::Expr& FormulaAST::GetEvalExpr() const {
+    if (eval_expr_released_) {
+        BuildEvalTree();
+    }
+    return eval_expr_ != nullptr ? *eval_expr_ : *root_expr_;
+}
+
+bool FormulaAST::CompileColumnKernel(ColumnKernel& kernel, Position origin) const {
+    kernel.ops.clear();
+    return GetEvalExpr().CompileColumnKernel(kernel, origin);
+}
+
+namespace {
+// Corners that fall into deleted lines move inward to the nearest surviving
+// line, so deleting lines inside a range shrinks it; a range that loses all
+// of its lines becomes invalid. Insertions inside a range widen it.
+CellRange ShiftRange(const CellRange& range, const std::function<Position(Position)>& shift) {
+    Position first = shift(range.first);
+    for (int row = range.first.row + 1; !first.IsValid() && row <= range.last.row; ++row) {
+        first = shift({row, range.first.col});
+    }
+    for (int col = range.first.col + 1; !first.IsValid() && col <= range.last.col; ++col) {
+        first = shift({range.first.row, col});
+    }
+    Position last = shift(range.last);
+    for (int row = range.last.row - 1; !last.IsValid() && row >= range.first.row; --row) {
+        last = shift({row, range.last.col});
+    }
+    for (int col = range.last.col - 1; !last.IsValid() && col >= range.first.col; --col) {
+        last = shift({range.last.row, col});
+    }
+    if (!first.IsValid() || !last.IsValid()) {
+        return {Position::NONE, Position::NONE};
+    }
+    return {first, last};
+}
+}  // namespace
+
+void FormulaAST::ShiftReferences(const std::function<Position(Position)>& shift) {
+    for (auto& cell : cells_) {
+        if (cell.IsValid()) {
+            cell = shift(cell);
+        }
+    }
+    cells_.sort();
+    for (auto& range : ranges_) {
+        if (range.IsValid()) {
+            range = ShiftRange(range, shift);
+        }
+    }
+    ranges_.sort();
+    UpdateReferenceLists();
+}
+
+void FormulaAST::ShiftExternalReferences(std::string_view sheet,
+                                         const std::function<Position(Position)>& shift) {
+    for (auto& cell : external_cells_) {
+        if (cell.sheet == sheet && cell.pos.IsValid()) {
+            cell.pos = shift(cell.pos);
+        }
+    }
+    external_cells_.sort();
+    UpdateReferenceLists();
 }
 
-std::vector<Position> FormulaAST::GetReferencedCells() const {
-    std::vector<Position> output;
+void FormulaAST::UpdateReferenceLists() {
+    // Both lists are sorted, so adjacent duplicates are all there is to drop.
+    // References to deleted cells aren't reported.
+    referenced_cells_.clear();
     for (auto cell : cells_) {
-        if (std::find(output.begin(),output.end(),cell)==output.end()){
-            output.push_back(cell);
+        if (cell.IsValid() && (referenced_cells_.empty() || !(referenced_cells_.back() == cell))) {
+            referenced_cells_.push_back(cell);
         }
     }
-    return output;
+    referenced_cells_.shrink_to_fit();
+    external_referenced_cells_.clear();
+    for (const auto& cell : external_cells_) {
+        if (cell.pos.IsValid()
+            && (external_referenced_cells_.empty() || !(external_referenced_cells_.back() == cell))) {
+            external_referenced_cells_.push_back(cell);
+        }
+    }
+    external_referenced_cells_.shrink_to_fit();
+    referenced_ranges_.clear();
+    for (const auto& range : ranges_) {
+        if (range.IsValid() && (referenced_ranges_.empty() || !(referenced_ranges_.back() == range))) {
+            referenced_ranges_.push_back(range);
+        }
+    }
+    referenced_ranges_.shrink_to_fit();
+}
+
+Span<Position> FormulaAST::GetReferencedCells() const {
+    return referenced_cells_;
+}
+
+Span<CellRange> FormulaAST::GetReferencedRanges() const {
+    return referenced_ranges_;
+}
+
+Span<SheetPosition> FormulaAST::GetExternalReferencedCells() const {
+    return external_referenced_cells_;
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    size_t usage = root_expr_->GetMemoryUsage();
+    for ([[maybe_unused]] const auto& cell : cells_) {
+        usage += sizeof(void*) + sizeof(Position);
+    }
+    for (const auto& cell : external_cells_) {
+        usage += sizeof(void*) + sizeof(SheetPosition);
+        if (cell.sheet.capacity() > std::string().capacity()) {
+            usage += cell.sheet.capacity() + 1;
+        }
+    }
+    for ([[maybe_unused]] const auto& range : ranges_) {
+        usage += sizeof(void*) + sizeof(CellRange);
+    }
+    usage += referenced_cells_.capacity() * sizeof(Position);
+    usage += referenced_ranges_.capacity() * sizeof(CellRange);
+    for (const auto& cell : external_referenced_cells_) {
+        usage += sizeof(SheetPosition);
+        if (cell.sheet.capacity() > std::string().capacity()) {
+            usage += cell.sheet.capacity() + 1;
+        }
+    }
+    return usage;
+}
+
+size_t FormulaAST::GetEvalTreeMemoryUsage() const {
+    return eval_expr_ != nullptr ? eval_expr_->GetMemoryUsage() : 0;
+}
+
+void FormulaAST::ReleaseEvalTree() {
+    // Shared subexpressions live only in the simplified tree
+    if (shared_ || eval_expr_ == nullptr) {
+        return;
+    }
+    eval_expr_.reset();
+    eval_expr_released_ = true;
+}
+
+void FormulaAST::ForEachSubexpression(const std::function<void(const std::string&)>& visit) const {
+    GetEvalExpr();
+    ASTImpl::CollectSubexpressions(eval_expr_ != nullptr ? *eval_expr_ : *root_expr_,
+                                   [&visit](ASTImpl::Expr& expr) {
+                                       visit(ASTImpl::GetSubexpressionText(expr));
+                                   });
+}
+
+void FormulaAST::ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup) {
+    if (eval_expr_ == nullptr) {
+        // The original tree is kept intact for printing, so the shared nodes
+        // go into a copy
+        eval_expr_released_ = false;
+        bool changed = false;
+        eval_expr_ = root_expr_->Optimize(changed);
+    }
+    std::unordered_map<const ASTImpl::Expr*, std::string> texts;
+    ASTImpl::CollectSubexpressions(*eval_expr_, [&texts](ASTImpl::Expr& expr) {
+        texts.emplace(&expr, ASTImpl::GetSubexpressionText(expr));
+    });
+    ASTImpl::ReplaceSubexpressions(eval_expr_, texts, [&](const std::string& text) {
+        const CellInterface* cell = lookup(text);
+        shared_ = shared_ || cell != nullptr;
+        return cell;
+    });
+}
+
+void FormulaAST::UnshareSubexpressions() {
+    if (shared_) {
+        BuildEvalTree();
+        shared_ = false;
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "column_kernel.h"
 #include "common.h"
 
 #include <forward_list>
@@ -13,7 +14,9 @@ class Expr;
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                        std::forward_list<SheetPosition> external_cells = {},
+                        std::forward_list<CellRange> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
@@ -22,10 +25,52 @@ public:
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
     void PrintCells(std::ostream& out) const;
-    std::vector<Position> GetReferencedCells() const;
+    // Sorted references without duplicates, built once at parse time and
+    // after shifts
+    Span<Position> GetReferencedCells() const;
+    // Ranges of the formula's own sheet, sorted, without duplicates and
+    // without ranges broken by deletions
+    Span<CellRange> GetReferencedRanges() const;
+    bool CompileColumnKernel(ColumnKernel& kernel, Position origin) const;
+    // CellExpr and RangeExpr nodes point into cells_ and ranges_, so rewriting
+    // the lists updates both trees
+    void ShiftReferences(const std::function<Position(Position)>& shift);
+    void ShiftExternalReferences(std::string_view sheet, const std::function<Position(Position)>& shift);
+    // References to other sheets, sorted and without duplicates
+    Span<SheetPosition> GetExternalReferencedCells() const;
+    // Heap memory of the parse tree and reference lists, in bytes
+    size_t GetMemoryUsage() const;
+    // Heap memory of the simplified tree. Releasing it frees the memory until
+    // the next Execute or CompileColumnKernel, which simplify the original
+    // tree again. A tree with shared subexpressions is kept.
+    size_t GetEvalTreeMemoryUsage() const;
+    void ReleaseEvalTree();
+    // Subexpressions that can be computed apart from the formula (see
+    // FormulaInterface::ForEachSubexpression), by canonical text
+    void ForEachSubexpression(const std::function<void(const std::string&)>& visit) const;
+    // Replaces the outermost subexpressions for which lookup gives a cell
+    // with reads of that cell's value, in the simplified tree only
+    void ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup);
+    void UnshareSubexpressions();
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // Simplified tree used for evaluation; null if nothing could be simplified.
+    // Printing always uses root_expr_ to keep the user's formula intact.
+    mutable std::unique_ptr<ASTImpl::Expr> eval_expr_;
+    // eval_expr_ was released and has to be rebuilt before evaluation
+    mutable bool eval_expr_released_ = false;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetPosition> external_cells_;
+    std::forward_list<CellRange> ranges_;
+    std::vector<Position> referenced_cells_;
+    std::vector<SheetPosition> external_referenced_cells_;
+    std::vector<CellRange> referenced_ranges_;
+    // eval_expr_ reads values of shared subexpressions from hidden cells
+    bool shared_ = false;
+
+    void UpdateReferenceLists();
+    void BuildEvalTree() const;
+    const ASTImpl::Expr& GetEvalExpr() const;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
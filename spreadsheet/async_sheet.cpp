@@ -0,0 +1,147 @@
+#include "async_sheet.h"
+
+#include "sheet.h"
+
+#include <exception>
+#include <iterator>
+
+AsyncSheet::AsyncSheet(Sheet& sheet)
+    : sheet_(sheet)
+    , engine_([this] { Run(); }) {
+}
+
+AsyncSheet::~AsyncSheet() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    engine_.join();
+}
+
+AsyncSheet::Edit AsyncSheet::SetCellAsync(Position pos, std::string text) {
+    return Enqueue(pos, std::move(text));
+}
+
+AsyncSheet::Edit AsyncSheet::ClearCellAsync(Position pos) {
+    return Enqueue(pos, std::nullopt);
+}
+
+AsyncSheet::Edit AsyncSheet::Enqueue(Position pos, std::optional<std::string> text) {
+    PendingEdit edit{pos, std::move(text), {}};
+    Edit result{0, edit.applied.get_future()};
+    {
+        std::lock_guard lock(mutex_);
+        result.sequence = ++issued_;
+        edits_.push_back(std::move(edit));
+    }
+    wake_.notify_one();
+    return result;
+}
+
+std::future<CellInterface::Value> AsyncSheet::GetValueAsync(Position pos) {
+    std::lock_guard lock(mutex_);
+    PendingRead read{pos, issued_, {}};
+    auto result = read.value.get_future();
+    reads_.push_back(std::move(read));
+    wake_.notify_one();
+    return result;
+}
+
+std::future<CellInterface::Value> AsyncSheet::GetValueAsync(Position pos, std::uint64_t sequence) {
+    std::lock_guard lock(mutex_);
+    PendingRead read{pos, sequence, {}};
+    auto result = read.value.get_future();
+    reads_.push_back(std::move(read));
+    wake_.notify_one();
+    return result;
+}
+
+std::uint64_t AsyncSheet::GetAppliedSequence() const {
+    std::lock_guard lock(mutex_);
+    return applied_;
+}
+
+// Поток движка забирает из очереди всё накопленное разом и применяет правки
+// без блокировки очереди, чтобы производители не ждали. Чтения с номером ещё
+// не поставленной правки откладываются до следующих пачек; если такие правки
+// так и не придут, при остановке они получают broken_promise.
+void AsyncSheet::Run() {
+    std::vector<PendingEdit> edits;
+    std::vector<PendingRead> reads;
+    std::vector<PendingRead> deferred;
+    std::uint64_t applied = 0;
+    bool stop = false;
+    while (!stop) {
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this] {
+                return stop_ || !edits_.empty() || !reads_.empty();
+            });
+            edits.swap(edits_);
+            reads.swap(reads_);
+            stop = stop_;
+        }
+        ApplyBatch(edits);
+        applied += edits.size();
+        edits.clear();
+        {
+            std::lock_guard lock(mutex_);
+            applied_ = applied;
+        }
+        // Отложенные чтения обслуживаются раньше новых, сохраняя порядок
+        if (!deferred.empty()) {
+            reads.insert(reads.begin(), std::make_move_iterator(deferred.begin()),
+                         std::make_move_iterator(deferred.end()));
+            deferred.clear();
+        }
+        ServeReads(reads, deferred, applied);
+        reads.clear();
+    }
+}
+
+// Правки пачки применяются по одной в порядке номеров: пропуск перекрытых
+// правок ячейки изменил бы результат, если последняя правка отвергнута, а
+// проверки циклов зависят от порядка правок разных ячеек. Кэш зависимых
+// формул сбрасывается один раз на пачку (Sheet::BeginBatch), а не на каждую
+// правку.
+void AsyncSheet::ApplyBatch(std::vector<PendingEdit>& edits) {
+    std::vector<std::exception_ptr> errors(edits.size());
+    sheet_.BeginBatch();
+    for (size_t i = 0; i < edits.size(); ++i) {
+        try {
+            if (edits[i].text) {
+                sheet_.SetCell(edits[i].pos, std::move(*edits[i].text));
+            } else {
+                sheet_.ClearCell(edits[i].pos);
+            }
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }
+    sheet_.EndBatch();
+    // Правка считается применённой, когда сброшен кэш её зависимых
+    for (size_t i = 0; i < edits.size(); ++i) {
+        if (errors[i]) {
+            edits[i].applied.set_exception(errors[i]);
+        } else {
+            edits[i].applied.set_value();
+        }
+    }
+}
+
+void AsyncSheet::ServeReads(std::vector<PendingRead>& reads, std::vector<PendingRead>& deferred,
+                            std::uint64_t applied) {
+    for (PendingRead& read : reads) {
+        if (read.sequence > applied) {
+            deferred.push_back(std::move(read));
+            continue;
+        }
+        try {
+            const CellInterface* cell = sheet_.GetCell(read.pos);
+            read.value.set_value(cell ? cell->GetValue() : CellInterface::Value(0.0));
+        } catch (...) {
+            read.value.set_exception(std::current_exception());
+        }
+    }
+}
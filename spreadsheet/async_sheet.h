@@ -0,0 +1,87 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Sheet;
+
+// Асинхронный доступ к листу. Правки ставятся в очередь и применяются
+// отдельным потоком движка, вызывающий поток не ждёт разбора формулы и сброса
+// кэша. Чтения возвращают future, который исполняется, когда применены все
+// правки до указанного номера и значение ячейки вычислено.
+//
+// Правки, накопившиеся в очереди от любых потоков, применяются одной пачкой
+// в порядке номеров, а чтения обслуживаются после пачки, так что зависимые
+// формулы пересчитываются один раз на пачку, а не на каждую правку.
+//
+// Пока объект существует, к листу нельзя обращаться напрямую.
+class AsyncSheet {
+public:
+    struct Edit {
+        // Номер правки; номера идут подряд, начиная с 1
+        std::uint64_t sequence;
+        // Исполняется, когда правка применена. Если правка отвергнута,
+        // хранит исключение
+        // (FormulaException, CircularDependencyException,
+        // InvalidPositionException).
+        std::future<void> applied;
+    };
+
+    explicit AsyncSheet(Sheet& sheet);
+    // Применяет оставшиеся правки и обслуживает ожидающие чтения
+    ~AsyncSheet();
+
+    AsyncSheet(const AsyncSheet&) = delete;
+    AsyncSheet& operator=(const AsyncSheet&) = delete;
+
+    Edit SetCellAsync(Position pos, std::string text);
+    Edit ClearCellAsync(Position pos);
+
+    // Значение ячейки после всех поставленных к этому моменту правок или
+    // после правок с номерами до sequence включительно. Пустая ячейка имеет
+    // значение 0, как пустая ячейка листа.
+    std::future<CellInterface::Value> GetValueAsync(Position pos);
+    std::future<CellInterface::Value> GetValueAsync(Position pos, std::uint64_t sequence);
+
+    // Номер последней применённой правки
+    std::uint64_t GetAppliedSequence() const;
+
+private:
+    struct PendingEdit {
+        Position pos;
+        // Отсутствие текста - очистка ячейки
+        std::optional<std::string> text;
+        std::promise<void> applied;
+    };
+
+    struct PendingRead {
+        Position pos;
+        std::uint64_t sequence;
+        std::promise<CellInterface::Value> value;
+    };
+
+    Edit Enqueue(Position pos, std::optional<std::string> text);
+    void Run();
+    void ApplyBatch(std::vector<PendingEdit>& edits);
+    // Обслуживает чтения, чьи правки применены; остальные переносит в deferred
+    void ServeReads(std::vector<PendingRead>& reads, std::vector<PendingRead>& deferred,
+                    std::uint64_t applied);
+
+    Sheet& sheet_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<PendingEdit> edits_;
+    std::vector<PendingRead> reads_;
+    std::uint64_t issued_ = 0;
+    std::uint64_t applied_ = 0;
+    bool stop_ = false;
+    std::thread engine_;
+};
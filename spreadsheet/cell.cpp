@@ -1,5 +1,9 @@
 #include "cell.h"
 
+#include "evaluation_limits.h"
+#include "sheet.h"
+#include "trace.h"
+
 #include <cassert>
 #include <string>
 #include <optional>
@@ -9,8 +13,9 @@
 
 // Конструктор и деструкор
 
-Cell::Cell(const std::string& text, SheetInterface* sheet, Position pos)
-    : sheet_(sheet) {
+Cell::Cell(const std::string& text, SheetInterface* sheet, Position pos, bool check_cycles)
+    : sheet_(sheet)
+    , pos_(pos) {
     if (text.empty()){
         type_ = Type::EMPTY;
         impl_= std::make_unique<EmptyImpl>();
@@ -26,32 +31,68 @@ Cell::Cell(const std::string& text, SheetInterface* sheet, Position pos)
         type_ = Type::TEXT;
         impl_= std::make_unique<TextImpl>(text);
     }
-    // Проверка на циклические зависимости
+    if (check_cycles){
+        CheckCircularDependency();
+    }
+}
+
+Cell::Cell(std::unique_ptr<FormulaInterface> formula, SheetInterface* sheet, Position pos, bool check_cycles)
+    : impl_(std::make_unique<FormulaImpl>(std::move(formula)))
+    , sheet_(sheet)
+    , pos_(pos)
+    , type_(Type::FORMULA) {
+    if (check_cycles){
+        CheckCircularDependency();
+    }
+}
+
+// Проверка на циклические зависимости
+
+void Cell::CheckCircularDependency() const {
     if (type_ == Type::FORMULA){
-        FormulaImpl* formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
-        std::queue<Position> queue;
-        for (auto p : formula_impl->GetReferencedCells()){
-            queue.push(p);
+        Trace::TraceSpan span("CycleCheck", pos_);
+        // Цикл может замкнуться только через формулы, ссылающиеся на позицию
+        // ячейки; если таких нет, обход не нужен
+        if (!static_cast<const Sheet*>(sheet_)->HasDependents(pos_)){
+            if (References(pos_)){
+                throw CircularDependencyException("");
+            }
+            return;
         }
-        std::set<Position> predecessors;
+        // Обход идёт по ячейкам всех листов книги: вершина - пара (лист, позиция)
+        using Node = std::pair<const SheetInterface*, Position>;
+        std::queue<Node> queue;
+        auto push_refs = [&queue](const SheetInterface* sheet, const Cell& cell){
+            for (auto p : cell.GetReferencedCellsView()){
+                queue.push({sheet,p});
+            }
+            for (const auto& range : cell.GetReferencedRangesView()){
+                sheet->ForEachCellInRange(range,[&queue,sheet](Position p, const CellInterface&){
+                    queue.push({sheet,p});
+                });
+            }
+            for (const auto& ref : cell.GetExternalReferencedCellsView()){
+                if (auto target = sheet->FindSheet(ref.sheet)){
+                    queue.push({target,ref.pos});
+                }
+            }
+        };
+        push_refs(sheet_,*this);
+        std::set<Node> predecessors;
         while (!queue.empty()) {
-            Position current = queue.front();
-            if (current == pos) {
+            Node current = queue.front();
+            if (current.first == sheet_ && current.second == pos_) {
                 throw CircularDependencyException("");
             }
             queue.pop();
-            auto cell = sheet_->GetCell(current);
-            if (cell != nullptr){
-                auto ref_cells = cell->GetReferencedCells();
-                for (Position x : ref_cells) {
-                    if (!predecessors.count(x)) {
-                        queue.push(x);
-                    }
-                }
-            } else {
-                sheet_->SetCell(current,"");
+            if (predecessors.count(current)){
+                continue;
             }
             predecessors.insert(current);
+            auto cell = dynamic_cast<const Cell*>(current.first->GetCell(current.second));
+            if (cell != nullptr){
+                push_refs(current.first,*cell);
+            }
         }
 
     }
@@ -82,35 +123,232 @@ Cell::~Cell() {
 // Инвалидация кэша
 
 void Cell::InvalidateCache() {
-    if (type_ == Type::FORMULA){
-        FormulaImpl* formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
-        formula_impl ->InvalidateCache();
+    InvalidateCaches({this});
+}
+
+// Обход по явному стеку: глубина цепочки зависимостей не ограничена стеком
+// потока. Множество посещённых ячеек нужно и для ромбовидных зависимостей, и
+// потому что у вытесненной ячейки (EvictCache) могут остаться вычисленные
+// зависимые: остановиться на уже сброшенной ячейке нельзя.
+void Cell::InvalidateCaches(const std::vector<Cell*>& cells) {
+    Trace::TraceSpan span("InvalidateCache", cells.size() == 1 ? cells.front()->pos_ : Position::NONE);
+    std::vector<Cell*> stack;
+    std::unordered_set<Cell*> visited;
+    auto visit = [&stack,&visited](Cell* cell){
+        if (cell != nullptr && visited.insert(cell).second){
+            stack.push_back(cell);
+        }
+    };
+    for (Cell* cell : cells){
+        visit(cell);
     }
-    for (auto cell : dependent_cells_){
-        if (cell != nullptr){
-            cell->InvalidateCache();
-        }    
+    std::vector<Cell*> range_dependents;
+    while (!stack.empty()){
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if (cell->type_ == Type::FORMULA){
+            FormulaImpl* formula_impl = static_cast<FormulaImpl*>(cell->impl_.get());
+            if (cell->profile_ != nullptr && formula_impl->IsCached()){
+                ++cell->profile_->invalidations;
+            }
+            formula_impl->InvalidateCache();
+        }
+        for (Cell* dep : cell->dependent_cells_){
+            visit(dep);
+        }
+        // Формулы, ссылающиеся на ячейку через диапазоны, хранит лист.
+        // Ячейки создаются только листом Sheet. У скрытых ячеек общих
+        // подвыражений позиции нет.
+        if (cell->sheet_ != nullptr && cell->pos_.IsValid()){
+            range_dependents.clear();
+            static_cast<Sheet*>(cell->sheet_)->NotifyValueChanged(cell->pos_,range_dependents);
+            for (Cell* dep : range_dependents){
+                visit(dep);
+            }
+        }
     }
 }
 
 // Получение значений
 
+namespace {
+// Суммарное время вычисления входов для каждой профилируемой ячейки,
+// вычисляемой в данный момент в этом потоке
+thread_local std::vector<std::chrono::nanoseconds> profile_frames;
+
+// Глубина вложенных вычислений формул в этом потоке (см. EvaluateInputs)
+thread_local int evaluation_depth = 0;
+
+class DepthGuard {
+public:
+    DepthGuard() {
+        ++evaluation_depth;
+    }
+    ~DepthGuard() {
+        --evaluation_depth;
+    }
+};
+}
+
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue(*sheet_);
+    if (!recently_used_.load(std::memory_order_relaxed)){
+        recently_used_.store(true,std::memory_order_relaxed);
+    }
+    if (type_ != Type::FORMULA || static_cast<FormulaImpl*>(impl_.get())->IsCached()){
+        return impl_->GetValue(*sheet_);
+    }
+    DepthGuard depth;
+    if (profile_ == nullptr){
+        EvaluateInputs();
+        Trace::TraceSpan span("Execute",pos_);
+        return impl_->GetValue(*sheet_);
+    }
+    profile_frames.emplace_back(0);
+    auto start = std::chrono::steady_clock::now();
+    Value result;
+    try {
+        EvaluateInputs();
+        Trace::TraceSpan span("Execute",pos_);
+        result = impl_->GetValue(*sheet_);
+    } catch (...) {
+        // Прерванное вычисление (EvaluationInterrupted) не учитывается
+        profile_frames.pop_back();
+        throw;
+    }
+    auto inclusive = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    auto inputs = profile_frames.back();
+    profile_frames.pop_back();
+    if (!profile_frames.empty()){
+        profile_frames.back() += inclusive;
+    }
+    profile_->inclusive += inclusive;
+    profile_->exclusive += inclusive - inputs;
+    ++profile_->evaluations;
+    return result;
+}
+
+// Обычно входы формулы вычисляются по мере надобности рекурсивно из
+// CellExpr::Evaluate: так невыбранная ветвь IF не вычисляется. Глубже
+// MAX_RECURSIVE_EVALUATION_DEPTH невычисленные прямые входы (ссылки на
+// ячейки своего и других листов) вычисляются заранее обходом в глубину по
+// явному стеку в порядке "сначала входы". К моменту вычисления каждой формулы
+// её входы уже в кэше, поэтому рекурсия дальше не растёт и глубина цепочки
+// ограничена только памятью. Формулы внутри диапазонов тоже входы: индексы
+// столбцов вычисляют их через GetValue, то есть рекурсивно.
+void Cell::EvaluateInputs() const {
+    if (evaluation_depth <= MAX_RECURSIVE_EVALUATION_DEPTH){
+        return;
+    }
+    struct Frame {
+        const Cell* cell;
+        // Следующий вход: сначала ссылки своего листа, затем внешние, затем
+        // невычисленные формулы диапазонов (собираются при первом обращении)
+        size_t next = 0;
+        std::optional<std::vector<const Cell*>> ranged;
+    };
+    auto is_pending = [](const CellInterface* target){
+        // Пустые позиции листа представлены не объектами Cell
+        auto raw = dynamic_cast<const Cell*>(target);
+        return raw != nullptr && raw->IsFormula() && !raw->HasCachedValue() ? raw : nullptr;
+    };
+    std::vector<Frame> stack;
+    stack.push_back({this});
+    while (!stack.empty()){
+        Frame& frame = stack.back();
+        const Cell* cell = frame.cell;
+        auto refs = cell->GetReferencedCellsView();
+        auto external = cell->GetExternalReferencedCellsView();
+        const Cell* input = nullptr;
+        while (input == nullptr && frame.next < refs.size() + external.size()){
+            size_t k = frame.next++;
+            const CellInterface* target = nullptr;
+            if (k < refs.size()){
+                if (refs[k].IsValid()){
+                    target = cell->sheet_->GetCell(refs[k]);
+                }
+            } else if (external[k-refs.size()].pos.IsValid()){
+                if (auto sheet = cell->sheet_->FindSheet(external[k-refs.size()].sheet)){
+                    target = sheet->GetCell(external[k-refs.size()].pos);
+                }
+            }
+            input = is_pending(target);
+        }
+        if (input == nullptr && !frame.ranged){
+            frame.ranged.emplace();
+            for (const auto& range : cell->GetReferencedRangesView()){
+                cell->sheet_->ForEachCellInRange(range,[&](Position, const CellInterface& target){
+                    if (auto raw = is_pending(&target)){
+                        frame.ranged->push_back(raw);
+                    }
+                });
+            }
+        }
+        while (input == nullptr && frame.next - refs.size() - external.size() < frame.ranged->size()){
+            auto raw = (*frame.ranged)[frame.next++ - refs.size() - external.size()];
+            // Формула могла вычислиться как вход предыдущей
+            if (!raw->HasCachedValue()){
+                input = raw;
+            }
+        }
+        if (input != nullptr){
+            CheckEvaluationLimits();
+            stack.push_back({input});
+            continue;
+        }
+        stack.pop_back();
+        // Входы ячейки вычислены; вычисляется и сама ячейка (кроме исходной,
+        // её вычисляет вызывающий GetValue)
+        if (!stack.empty() && !cell->HasCachedValue()){
+            cell->GetValue();
+        }
+    }
 }
 
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {   
+std::string_view Cell::GetTextView() const {
+    return impl_->GetText();
+}
+
+std::vector<Position> Cell::GetReferencedCells() const {
+    return GetReferencedCellsView().ToVector();
+}
+
+Span<Position> Cell::GetReferencedCellsView() const {
     if (type_ == Type::FORMULA){
-        FormulaImpl* formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
-        return formula_impl->GetReferencedCells();
+        return static_cast<FormulaImpl*>(impl_.get())->GetFormula().GetReferencedCellsView();
+    }
+    return {};
+}
+
+Span<CellRange> Cell::GetReferencedRangesView() const {
+    if (type_ == Type::FORMULA){
+        return static_cast<FormulaImpl*>(impl_.get())->GetFormula().GetReferencedRangesView();
     }
     return {};
 }
 
+bool Cell::References(Position pos) const {
+    auto refs = GetReferencedCellsView();
+    if (std::binary_search(refs.begin(),refs.end(),pos)){
+        return true;
+    }
+    for (const auto& range : GetReferencedRangesView()){
+        if (range.Contains(pos)){
+            return true;
+        }
+    }
+    for (const auto& ref : GetExternalReferencedCellsView()){
+        if (ref.pos == pos && sheet_->FindSheet(ref.sheet) == sheet_){
+            return true;
+        }
+    }
+    return false;
+}
+
 void Cell::SetDependentCells(const std::set<Cell*>& cells) {
     dependent_cells_ = cells;
 }
@@ -119,6 +357,161 @@ std::set<Cell*> Cell::GetDependentCells() const {
     return dependent_cells_;
 }
 
+bool Cell::HasDependentCells() const {
+    return !dependent_cells_.empty();
+}
+
+void Cell::AddDependentCell(Cell* cell) {
+    dependent_cells_.insert(cell);
+}
+
+void Cell::RemoveDependentCell(Cell* cell) {
+    dependent_cells_.erase(cell);
+}
+
+std::vector<SheetPosition> Cell::GetExternalReferencedCells() const {
+    return GetExternalReferencedCellsView().ToVector();
+}
+
+Span<SheetPosition> Cell::GetExternalReferencedCellsView() const {
+    if (type_ == Type::FORMULA){
+        return static_cast<FormulaImpl*>(impl_.get())->GetFormula().GetExternalReferencedCellsView();
+    }
+    return {};
+}
+
+const SheetInterface* Cell::GetSheet() const {
+    return sheet_;
+}
+
+void Cell::ShiftExternalReferences(std::string_view sheet, const std::function<Position(Position)>& shift) {
+    if (type_ == Type::FORMULA){
+        auto formula_impl = static_cast<FormulaImpl*>(impl_.get());
+        formula_impl->GetFormula().ShiftExternalReferences(sheet,shift);
+        formula_impl->UpdateText();
+    }
+}
+
+void Cell::SetPosition(Position pos) {
+    pos_ = pos;
+}
+
+void Cell::ShiftReferences(const std::function<Position(Position)>& shift) {
+    if (type_ == Type::FORMULA){
+        auto formula_impl = static_cast<FormulaImpl*>(impl_.get());
+        formula_impl->GetFormula().ShiftReferences(shift);
+        formula_impl->UpdateText();
+    }
+}
+
+void Cell::EnableProfiling(bool enable) {
+    if (!enable){
+        profile_.reset();
+    } else if (profile_ == nullptr){
+        profile_ = std::make_unique<CellProfile>();
+    }
+}
+
+const CellProfile* Cell::GetProfile() const {
+    return profile_.get();
+}
+
+bool Cell::IsFormula() const {
+    return type_ == Type::FORMULA;
+}
+
+void Cell::ForEachSubexpression(const std::function<void(const std::string&)>& visit) const {
+    if (type_ == Type::FORMULA){
+        static_cast<FormulaImpl*>(impl_.get())->GetFormula().ForEachSubexpression(visit);
+    }
+}
+
+// Значение формулы не меняется, поэтому кэш не сбрасывается
+void Cell::ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup) {
+    if (type_ == Type::FORMULA){
+        static_cast<FormulaImpl*>(impl_.get())->GetFormula().ShareSubexpressions(lookup);
+    }
+}
+
+void Cell::UnshareSubexpressions() {
+    if (type_ == Type::FORMULA){
+        static_cast<FormulaImpl*>(impl_.get())->GetFormula().UnshareSubexpressions();
+    }
+}
+
+bool Cell::CompileColumnKernel(ColumnKernel& kernel) const {
+    if (type_ != Type::FORMULA){
+        return false;
+    }
+    return static_cast<FormulaImpl*>(impl_.get())->GetFormula().CompileColumnKernel(pos_,kernel);
+}
+
+bool Cell::HasCachedValue() const {
+    return type_ == Type::FORMULA && static_cast<FormulaImpl*>(impl_.get())->IsCached();
+}
+
+void Cell::SetCachedValue(const Value& value) {
+    if (type_ == Type::FORMULA){
+        static_cast<FormulaImpl*>(impl_.get())->SetCache(value);
+    }
+}
+
+namespace {
+size_t StringHeapBytes(const std::string& str) {
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+// Узел красно-чёрного дерева std::set: три указателя, цвет и значение
+const size_t SET_NODE_BYTES = 4 * sizeof(void*) + sizeof(Cell*);
+}
+
+void Cell::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(Cell);
+    if (profile_ != nullptr){
+        usage.cells += sizeof(CellProfile);
+    }
+    usage.dependencies += dependent_cells_.size() * SET_NODE_BYTES;
+    if (type_ == Type::FORMULA){
+        auto formula_impl = static_cast<const FormulaImpl*>(impl_.get());
+        const FormulaInterface& formula = formula_impl->GetFormula();
+        // Место под кэш учитывается в cache, пока в нём есть значение
+        usage.cells += sizeof(FormulaImpl) - sizeof(std::optional<Value>);
+        usage.text += StringHeapBytes(formula_impl->GetText());
+        usage.ast += formula.GetAstMemoryUsage();
+        usage.cache += formula.GetEvalTreeMemoryUsage();
+        if (formula_impl->IsCached()){
+            usage.cache += sizeof(std::optional<Value>);
+        }
+    } else if (type_ == Type::TEXT){
+        usage.cells += sizeof(TextImpl);
+        usage.text += StringHeapBytes(impl_->GetText());
+    } else {
+        usage.cells += sizeof(EmptyImpl);
+    }
+}
+
+bool Cell::ResetRecentlyUsed() {
+    return recently_used_.exchange(false,std::memory_order_relaxed);
+}
+
+size_t Cell::EvictCache() {
+    if (type_ != Type::FORMULA){
+        return 0;
+    }
+    auto formula_impl = static_cast<FormulaImpl*>(impl_.get());
+    FormulaInterface& formula = formula_impl->GetFormula();
+    size_t freed = formula.GetEvalTreeMemoryUsage();
+    if (formula_impl->IsCached()){
+        freed += sizeof(std::optional<Value>);
+    }
+    // Зависимые ячейки не сбрасываются: значение не изменилось. Упрощённое
+    // дерево строится заново при следующем вычислении, дерево с общими
+    // подвыражениями не освобождается
+    formula_impl->InvalidateCache();
+    formula.ReleaseEvalTree();
+    return freed-formula.GetEvalTreeMemoryUsage();
+}
+
 // Методы имплементаций
     
 // Получение значений
@@ -137,7 +530,7 @@ Cell::Value Cell::TextImpl::GetValue([[maybe_unused]] const SheetInterface& shee
     return text_;
 }
 
-std::string Cell::TextImpl::GetText() const {
+const std::string& Cell::TextImpl::GetText() const {
     return text_;
 }
 
@@ -156,24 +549,41 @@ Cell::Value Cell::FormulaImpl::GetValue([[maybe_unused]] const SheetInterface& s
     return result;
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_->GetExpression();
+const std::string& Cell::FormulaImpl::GetText() const {
+    return text_;
 }
 
-Cell::Value Cell::EmptyImpl::GetValue([[maybe_unused]] const SheetInterface& sheet) const {
-    return 0.0;
+void Cell::FormulaImpl::UpdateText() {
+    text_ = FORMULA_SIGN + formula_->GetExpression();
 }
 
-std::string Cell::EmptyImpl::GetText() const {
-    return "";
+Cell::Value Cell::EmptyImpl::GetValue([[maybe_unused]] const SheetInterface& sheet) const {
+    return 0.0;
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+const std::string& Cell::EmptyImpl::GetText() const {
+    static const std::string empty;
+    return empty;
 }
 
 // Инвалидация кэша
 
 void Cell::FormulaImpl::InvalidateCache() {
     cache_.reset();
+}
+
+bool Cell::FormulaImpl::IsCached() const {
+    return cache_.has_value();
+}
+
+void Cell::FormulaImpl::SetCache(const Value& value) {
+    cache_ = value;
+}
+
+const FormulaInterface& Cell::FormulaImpl::GetFormula() const {
+    return *formula_;
+}
+
+FormulaInterface& Cell::FormulaImpl::GetFormula() {
+    return *formula_;
 }
\ No newline at end of file
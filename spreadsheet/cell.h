@@ -2,12 +2,43 @@
 
 #include "common.h"
 #include "formula.h"
+#include <atomic>
+#include <chrono>
 #include <unordered_set>
 #include <optional>
 #include <set>
 #include <iostream>
 
-
+// Статистика вычислений формульной ячейки в режиме профилирования
+struct CellProfile {
+    // Время вычислений вместе со временем вычисления входов и без него
+    std::chrono::nanoseconds inclusive{0};
+    std::chrono::nanoseconds exclusive{0};
+    size_t evaluations = 0;
+    // Сколько раз сбрасывалось уже вычисленное значение
+    size_t invalidations = 0;
+};
+
+// Оценка занимаемой памяти в байтах по категориям
+struct SheetMemoryUsage {
+    // Хеш-таблица ячеек листа
+    size_t storage = 0;
+    // Объекты ячеек и их имплементаций
+    size_t cells = 0;
+    // Строки, размещённые вне объектов
+    size_t text = 0;
+    // Деревья разбора формул и списки ссылок
+    size_t ast = 0;
+    // Вычисленные значения формул и упрощённые деревья для вычисления: их
+    // можно освободить и получить заново при обращении
+    size_t cache = 0;
+    // Узлы множеств зависимых ячеек
+    size_t dependencies = 0;
+
+    size_t Total() const {
+        return storage + cells + text + ast + cache + dependencies;
+    }
+};
 
 class Cell : public CellInterface {
     enum Type {
@@ -16,23 +47,85 @@ class Cell : public CellInterface {
         FORMULA
     };
 public:
-    explicit Cell(const std::string& text, SheetInterface* sheet, Position pos);
+    // check_cycles = false - формула заведомо не образует цикл (например,
+    // восстанавливается из журнала), проверка пропускается
+    explicit Cell(const std::string& text, SheetInterface* sheet, Position pos, bool check_cycles = true);
+    // Формульная ячейка из уже разобранной формулы (см. ParseFormulas)
+    Cell(std::unique_ptr<FormulaInterface> formula, SheetInterface* sheet, Position pos, bool check_cycles = true);
     ~Cell();
 
     Value GetValue() const override;
     std::string GetText() const override;
+    // То же без копирования. Текст формулы строится один раз при разборе и
+    // при сдвиге ссылок.
+    std::string_view GetTextView() const;
     std::vector<Position> GetReferencedCells() const override;
-
+    // То же без копирования: данные принадлежат формуле ячейки
+    Span<Position> GetReferencedCellsView() const;
+    // Ссылки формулы на ячейки других листов книги
+    std::vector<SheetPosition> GetExternalReferencedCells() const;
+    Span<SheetPosition> GetExternalReferencedCellsView() const;
+    // Диапазоны своего листа, на которые ссылается формула
+    Span<CellRange> GetReferencedRangesView() const;
+    // Ссылается ли формула на позицию своего листа: напрямую, через диапазон
+    // или по имени своего листа
+    bool References(Position pos) const;
+    const SheetInterface* GetSheet() const;
+
+    // Сбрасывает значение ячейки и всех формул, зависящих от неё напрямую,
+    // через диапазоны и через ссылки с других листов
     void InvalidateCache();
+    // То же для нескольких ячеек одним обходом
+    static void InvalidateCaches(const std::vector<Cell*>& cells);
+    // Бросает CircularDependencyException, если формула ячейки через ссылки
+    // приходит к собственной позиции
+    void CheckCircularDependency() const;
     void SetDependentCells(const std::set<Cell*>& cells);
     std::set<Cell*> GetDependentCells() const;
+    bool HasDependentCells() const;
+    void AddDependentCell(Cell* cell);
+    void RemoveDependentCell(Cell* cell);
+
+    // Используются при вставке и удалении строк и столбцов
+    void SetPosition(Position pos);
+    void ShiftReferences(const std::function<Position(Position)>& shift);
+    void ShiftExternalReferences(std::string_view sheet, const std::function<Position(Position)>& shift);
+
+    // Включает/выключает сбор статистики. При выключении статистика удаляется.
+    void EnableProfiling(bool enable);
+    const CellProfile* GetProfile() const;
+    bool IsFormula() const;
+
+    // Общие подвыражения формулы (см. FormulaInterface::ForEachSubexpression)
+    void ForEachSubexpression(const std::function<void(const std::string&)>& visit) const;
+    void ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup);
+    void UnshareSubexpressions();
+
+    // Вычисление по столбцу (см. ColumnKernel)
+    bool CompileColumnKernel(ColumnKernel& kernel) const;
+    bool HasCachedValue() const;
+    void SetCachedValue(const Value& value);
+
+    // Добавляет к usage память, занятую ячейкой
+    void AddMemoryUsage(SheetMemoryUsage& usage) const;
+    // Сбрасывает признак чтения значения, возвращает его прежнее значение
+    bool ResetRecentlyUsed();
+    // Освобождает вычисленное значение и упрощённое дерево формулы,
+    // возвращает число освобождённых байт (в терминах SheetMemoryUsage::cache)
+    size_t EvictCache();
 private:
+    // Вычисляет невычисленные входы формулы перед её вычислением, если
+    // вычисления в потоке вложены глубже MAX_RECURSIVE_EVALUATION_DEPTH
+    void EvaluateInputs() const;
+
+    static const int MAX_RECURSIVE_EVALUATION_DEPTH = 128;
 
     // Базовый класс имплементации
     class Impl {
         public:
+            virtual ~Impl() = default;
             virtual Value GetValue([[maybe_unused]] const SheetInterface& sheet) const = 0;
-            virtual std::string GetText() const = 0;
+            virtual const std::string& GetText() const = 0;
     };
 
     // Имплементация текстовой ячейки
@@ -41,7 +134,7 @@ private:
             TextImpl(const std::string& text)
                 : text_(text) {}
             Value GetValue([[maybe_unused]] const SheetInterface& sheet) const override;
-            std::string GetText() const override;
+            const std::string& GetText() const override;
         private:
             std::string text_ = "";
     };
@@ -49,21 +142,31 @@ private:
     // Имплементация формульной ячейки
     class FormulaImpl : public Impl {
         public:
-            FormulaImpl(const std::string& formula) 
-                : text_(formula){
+            FormulaImpl(const std::string& formula) {
                     try {
                         formula_ = ParseFormula(formula);
                     } catch (const FormulaException& e){
                         throw e;
                     }
+                    UpdateText();
+                }
+            FormulaImpl(std::unique_ptr<FormulaInterface> formula)
+                : formula_(std::move(formula)) {
+                    UpdateText();
                 }
             Value GetValue([[maybe_unused]] const SheetInterface& sheet) const override;
-            std::string GetText() const override;
+            const std::string& GetText() const override;
 
-            std::vector<Position> GetReferencedCells() const;
             void InvalidateCache();
+            bool IsCached() const;
+            void SetCache(const Value& value);
+            const FormulaInterface& GetFormula() const;
+            FormulaInterface& GetFormula();
+            // Перестраивает текст после изменения ссылок формулы
+            void UpdateText();
 
         private:
+            // Каноничный текст формулы со знаком FORMULA_SIGN
             std::string text_ = "";
             std::unique_ptr<FormulaInterface> formula_;
 
@@ -75,14 +178,21 @@ private:
     class EmptyImpl : public Impl {
         public:
             Value GetValue([[maybe_unused]] const SheetInterface& sheet) const override;
-            std::string GetText() const override;
+            const std::string& GetText() const override;
     };
 
     std::unique_ptr<Impl> impl_;
 
     mutable SheetInterface* sheet_;
+    Position pos_;
 
     // Зависимые ячейки, от текущей
     std::set<Cell*> dependent_cells_;
     Cell::Type type_;
+    // Значение читалось с момента последнего ResetRecentlyUsed. Значения
+    // ячеек одного листа могут читаться из потоков пересчёта других листов.
+    mutable std::atomic<bool> recently_used_{false};
+
+    // Заполнено только в режиме профилирования
+    mutable std::unique_ptr<CellProfile> profile_;
 };
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "column_aggregates.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+const double INF = std::numeric_limits<double>::infinity();
+}
+
+ColumnAggregates::Node ColumnAggregates::Combine(const Node& lhs, const Node& rhs) {
+    return {lhs.sum + rhs.sum, std::min(lhs.min, rhs.min), std::max(lhs.max, rhs.max)};
+}
+
+ColumnAggregates::Node ColumnAggregates::Leaf(std::optional<double> number) {
+    if (!number) {
+        return {0.0, INF, -INF};
+    }
+    return {*number, *number, *number};
+}
+
+void ColumnAggregates::AddFenwick(std::vector<int>& tree, size_t row, int delta) {
+    for (size_t i = row + 1; i < tree.size(); i += i & (~i + 1)) {
+        tree[i] += delta;
+    }
+}
+
+int ColumnAggregates::PrefixFenwick(const std::vector<int>& tree, size_t rows) {
+    int result = 0;
+    for (size_t i = std::min(rows, tree.size() - 1); i > 0; i -= i & (~i + 1)) {
+        result += tree[i];
+    }
+    return result;
+}
+
+// Перестройка за O(n): листья копируются, внутренние узлы и деревья Фенвика
+// строятся снизу вверх
+void ColumnAggregates::Grow(size_t rows) {
+    size_t size = std::max<size_t>(size_, 1);
+    while (size < rows) {
+        size *= 2;
+    }
+    std::vector<Node> tree(2 * size, Leaf(std::nullopt));
+    std::copy(tree_.begin() + size_, tree_.end(), tree.begin() + size);
+    for (size_t i = size - 1; i > 0; --i) {
+        tree[i] = Combine(tree[2 * i], tree[2 * i + 1]);
+    }
+    kinds_.resize(size, Kind::None);
+    counts_.assign(size + 1, 0);
+    errors_.assign(size + 1, 0);
+    for (size_t i = 1; i <= size; ++i) {
+        counts_[i] += kinds_[i - 1] == Kind::Number;
+        errors_[i] += kinds_[i - 1] == Kind::Error;
+        size_t parent = i + (i & (~i + 1));
+        if (parent <= size) {
+            counts_[parent] += counts_[i];
+            errors_[parent] += errors_[i];
+        }
+    }
+    tree_ = std::move(tree);
+    size_ = size;
+}
+
+void ColumnAggregates::Set(int row, std::optional<double> number, bool error) {
+    size_t index = static_cast<size_t>(row);
+    Kind kind = number ? Kind::Number : error ? Kind::Error : Kind::None;
+    if (index >= size_) {
+        if (kind == Kind::None) {
+            return;
+        }
+        Grow(index + 1);
+    }
+    Kind old = kinds_[index];
+    if (old != kind) {
+        AddFenwick(counts_, index, (kind == Kind::Number) - (old == Kind::Number));
+        AddFenwick(errors_, index, (kind == Kind::Error) - (old == Kind::Error));
+        kinds_[index] = kind;
+    }
+    size_t node = size_ + index;
+    tree_[node] = Leaf(number);
+    for (node /= 2; node > 0; node /= 2) {
+        tree_[node] = Combine(tree_[2 * node], tree_[2 * node + 1]);
+    }
+}
+
+ColumnAggregates::Summary ColumnAggregates::Query(int first_row, int last_row) const {
+    Summary summary;
+    size_t first = static_cast<size_t>(std::max(first_row, 0));
+    size_t last = std::min(static_cast<size_t>(last_row) + 1, size_);
+    if (first >= last) {
+        return summary;
+    }
+    summary.count = PrefixFenwick(counts_, last) - PrefixFenwick(counts_, first);
+    summary.errors = PrefixFenwick(errors_, last) - PrefixFenwick(errors_, first);
+    // Подъём от границ полуинтервала [first, last) к корню: left копит узлы
+    // левого края, right - правого, так что узлы складываются в порядке строк
+    Node left = Leaf(std::nullopt);
+    Node right = Leaf(std::nullopt);
+    for (size_t l = first + size_, r = last + size_; l < r; l /= 2, r /= 2) {
+        if (l & 1) {
+            left = Combine(left, tree_[l++]);
+        }
+        if (r & 1) {
+            right = Combine(tree_[--r], right);
+        }
+    }
+    Node total = Combine(left, right);
+    summary.sum = total.sum;
+    summary.min = total.min;
+    summary.max = total.max;
+    return summary;
+}
+
+size_t ColumnAggregates::MemoryUsage() const {
+    return tree_.capacity() * sizeof(Node) + kinds_.capacity() * sizeof(Kind)
+        + (counts_.capacity() + errors_.capacity()) * sizeof(int);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// Агрегаты значений одного столбца по номерам строк. Суммы, минимумы и
+// максимумы хранятся в дереве отрезков, число числовых ячеек и ошибок - в
+// деревьях Фенвика. Изменение строки и запрос по любому отрезку строк стоят
+// O(log n) и не затрагивают ячейки внутри отрезка. Сумма узла каждый раз
+// пересчитывается из детей, а не правится на разность, поэтому погрешность
+// не накапливается от правок.
+class ColumnAggregates {
+public:
+    struct Summary {
+        double sum = 0.0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        int count = 0;
+        int errors = 0;
+    };
+
+    // Значение строки: число (number), ошибка (error) или ничего - пустая или
+    // текстовая ячейка. Таблица растёт по мере появления новых строк.
+    void Set(int row, std::optional<double> number, bool error);
+    // Сводка по строкам first_row..last_row включительно
+    Summary Query(int first_row, int last_row) const;
+
+    size_t MemoryUsage() const;
+
+private:
+    enum class Kind : char {
+        None,
+        Number,
+        Error,
+    };
+
+    struct Node {
+        double sum;
+        double min;
+        double max;
+    };
+
+    static Node Combine(const Node& lhs, const Node& rhs);
+    static Node Leaf(std::optional<double> number);
+    void Grow(size_t rows);
+    static void AddFenwick(std::vector<int>& tree, size_t row, int delta);
+    static int PrefixFenwick(const std::vector<int>& tree, size_t rows);
+
+    // Число листьев дерева отрезков, степень двойки
+    size_t size_ = 0;
+    // Узел i имеет детей 2i и 2i+1, листья начинаются с size_
+    std::vector<Node> tree_;
+    std::vector<Kind> kinds_;
+    // Деревья Фенвика с индексацией с единицы
+    std::vector<int> counts_;
+    std::vector<int> errors_;
+};
@@ -0,0 +1,146 @@
+#include "column_kernel.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+// 0 - нет ошибки, иначе категория ошибки + 1
+using ErrorCode = std::uint8_t;
+
+ErrorCode ToErrorCode(FormulaError::Category category) {
+    return static_cast<ErrorCode>(static_cast<int>(category) + 1);
+}
+
+const ErrorCode ARITHMETIC_ERROR = ToErrorCode(FormulaError::Category::Arithmetic);
+
+struct Lanes {
+    std::vector<double> values;
+    std::vector<ErrorCode> errors;
+};
+
+// Повторяет преобразование значения ячейки в CellExpr::Evaluate
+void GatherColumn(const SheetInterface& sheet, Position first, int count, Lanes& lanes) {
+    for (int i = 0; i < count; ++i) {
+        Position pos{first.row + i, first.col};
+        if (!pos.IsValid()) {
+            lanes.errors[i] = ToErrorCode(FormulaError::Category::Ref);
+            continue;
+        }
+        auto cell = sheet.GetCell(pos);
+        if (cell == nullptr) {
+            continue;
+        }
+        auto value = cell->GetValue();
+        if (std::holds_alternative<double>(value)) {
+            lanes.values[i] = std::get<double>(value);
+        } else if (std::holds_alternative<FormulaError>(value)) {
+            lanes.errors[i] = ToErrorCode(std::get<FormulaError>(value).GetCategory());
+        } else {
+            lanes.errors[i] = ToErrorCode(FormulaError::Category::Value);
+        }
+    }
+}
+
+// Циклы ниже не содержат ветвлений и зависимостей между итерациями, поэтому
+// компилятор векторизует их.
+template <typename Operation>
+void ApplyBinary(Lanes& lhs, const Lanes& rhs, Operation operation) {
+    const size_t count = lhs.values.size();
+    double* l = lhs.values.data();
+    const double* r = rhs.values.data();
+    for (size_t i = 0; i < count; ++i) {
+        l[i] = operation(l[i], r[i]);
+    }
+    ErrorCode* l_err = lhs.errors.data();
+    const ErrorCode* r_err = rhs.errors.data();
+    for (size_t i = 0; i < count; ++i) {
+        // Левый операнд вычисляется первым, поэтому его ошибка приоритетнее
+        ErrorCode operand_error = l_err[i] != 0 ? l_err[i] : r_err[i];
+        ErrorCode result_error = std::isfinite(l[i]) ? 0 : ARITHMETIC_ERROR;
+        l_err[i] = operand_error != 0 ? operand_error : result_error;
+    }
+}
+
+}  // namespace
+
+bool ColumnKernel::Op::operator==(const Op& rhs) const {
+    return code == rhs.code && row_offset == rhs.row_offset && col == rhs.col
+        && (code != OpCode::PushConst || std::memcmp(&value, &rhs.value, sizeof(value)) == 0);
+}
+
+bool ColumnKernel::operator==(const ColumnKernel& rhs) const {
+    return ops == rhs.ops;
+}
+
+bool ColumnKernel::operator!=(const ColumnKernel& rhs) const {
+    return !(*this == rhs);
+}
+
+bool ColumnKernel::ReferencesColumn(int col) const {
+    for (const Op& op : ops) {
+        if (op.code == OpCode::PushRef && op.col == col) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::variant<double, FormulaError>> EvaluateColumnKernel(
+    const ColumnKernel& kernel, const SheetInterface& sheet, int first_row, int count) {
+    std::vector<Lanes> stack;
+    for (const ColumnKernel::Op& op : kernel.ops) {
+        using OpCode = ColumnKernel::OpCode;
+        if (op.code == OpCode::PushRef || op.code == OpCode::PushConst) {
+            Lanes lanes{std::vector<double>(count, op.value), std::vector<ErrorCode>(count, 0)};
+            if (op.code == OpCode::PushRef) {
+                GatherColumn(sheet, {first_row + op.row_offset, op.col}, count, lanes);
+            }
+            stack.push_back(std::move(lanes));
+            continue;
+        }
+        if (op.code == OpCode::Negate) {
+            assert(!stack.empty());
+            for (double& value : stack.back().values) {
+                value = -value;
+            }
+            continue;
+        }
+        assert(stack.size() >= 2);
+        Lanes rhs = std::move(stack.back());
+        stack.pop_back();
+        Lanes& lhs = stack.back();
+        switch (op.code) {
+            case OpCode::Add:
+                ApplyBinary(lhs, rhs, [](double l, double r) { return l + r; });
+                break;
+            case OpCode::Subtract:
+                ApplyBinary(lhs, rhs, [](double l, double r) { return l - r; });
+                break;
+            case OpCode::Multiply:
+                ApplyBinary(lhs, rhs, [](double l, double r) { return l * r; });
+                break;
+            case OpCode::Divide:
+                // деление на ноль даёт inf или nan и помечается как ARITHM
+                ApplyBinary(lhs, rhs, [](double l, double r) { return l / r; });
+                break;
+            default:
+                assert(false);
+        }
+    }
+    assert(stack.size() == 1);
+
+    std::vector<std::variant<double, FormulaError>> result;
+    result.reserve(count);
+    const Lanes& lanes = stack.back();
+    for (int i = 0; i < count; ++i) {
+        if (lanes.errors[i] != 0) {
+            result.emplace_back(FormulaError(static_cast<FormulaError::Category>(lanes.errors[i] - 1)));
+        } else {
+            result.emplace_back(lanes.values[i]);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <variant>
+#include <vector>
+
+// Формула, записанная как последовательность операций над стеком, в которой
+// ссылки на ячейки заданы смещением строки относительно самой ячейки. Формулы
+// одного столбца, отличающиеся только номером строки (=B2*C2-D2, =B3*C3-D3,
+// ...), дают одинаковые ядра и могут быть вычислены за один проход по столбцу.
+struct ColumnKernel {
+    enum class OpCode : char {
+        PushRef,
+        PushConst,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    struct Op {
+        OpCode code;
+        // Значение константы для PushConst
+        double value = 0.0;
+        // Ссылка для PushRef: смещение строки и абсолютный столбец
+        int row_offset = 0;
+        int col = 0;
+
+        bool operator==(const Op& rhs) const;
+    };
+
+    std::vector<Op> ops;
+
+    bool operator==(const ColumnKernel& rhs) const;
+    bool operator!=(const ColumnKernel& rhs) const;
+
+    // Ссылается ли ядро на ячейки указанного столбца
+    bool ReferencesColumn(int col) const;
+};
+
+// Вычисляет ядро для строк first_row .. first_row + count - 1. Значения
+// ссылок собираются в непрерывные массивы, операции применяются ко всему
+// массиву сразу, ошибки хранятся для каждой строки отдельно и имеют тот же
+// приоритет, что и при вычислении по одной ячейке.
+std::vector<std::variant<double, FormulaError>> EvaluateColumnKernel(
+    const ColumnKernel& kernel, const SheetInterface& sheet, int first_row, int count);
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <functional>
 #include <iosfwd>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -26,6 +29,75 @@ struct Position {
     static const Position NONE;
 };
 
+// Ссылка на ячейку другого листа книги, например Sheet2!A1 или 'Лист 2'!A1
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const;
+    bool operator<(const SheetPosition& rhs) const;
+
+    // Имя листа в формуле: в кавычках, если оно не является идентификатором
+    std::string ToString() const;
+};
+
+// Прямоугольный диапазон ячеек, например A1:B10. first - левый верхний угол,
+// last - правый нижний.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(const CellRange& rhs) const;
+    bool operator<(const CellRange& rhs) const;
+
+    // Диапазон с некорректным углом (например, после удаления строки с
+    // углом) вычисляется и печатается как #REF!; такой текст разбирается
+    // обратно в некорректную ссылку
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+};
+
+// Непрерывная последовательность элементов без владения (аналог std::span из
+// C++20). Действительна, пока не изменён объект, которому принадлежат данные.
+template <typename T>
+class Span {
+public:
+    Span() = default;
+    Span(const T* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+    Span(const std::vector<T>& items)
+        : data_(items.data())
+        , size_(items.size()) {
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+    const T* end() const {
+        return data_ + size_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+    std::vector<T> ToVector() const {
+        return {begin(), end()};
+    }
+
+private:
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -76,6 +148,18 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Сводка по значениям ячеек диапазона для агрегатных функций. Пустые и
+// текстовые ячейки не учитываются.
+struct RangeSummary {
+    double sum = 0.0;
+    // Число ячеек с числовым значением
+    size_t count = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    // Одна из ошибок в ячейках диапазона, если они есть
+    std::optional<FormulaError> error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -143,6 +227,29 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист книги с указанным именем. Используется для вычисления
+    // ссылок на другие листы. Таблица вне книги других листов не видит.
+    virtual const SheetInterface* FindSheet([[maybe_unused]] std::string_view name) const {
+        return nullptr;
+    }
+
+    // Обходит существующие ячейки диапазона в произвольном порядке.
+    // Реализация по умолчанию проверяет каждую позицию диапазона.
+    virtual void ForEachCellInRange(const CellRange& range,
+                                    const std::function<void(Position, const CellInterface&)>& action) const;
+
+    // Ищет число key в столбце col среди строк first_row..last_row и
+    // возвращает номер строки. exact = true - первая строка со значением,
+    // равным key; exact = false - наибольшее значение, не превосходящее key
+    // (из равных - последняя строка). Пустые и текстовые ячейки и ошибки
+    // пропускаются. Реализация по умолчанию просматривает столбец целиком,
+    // таблица может использовать индексы.
+    virtual std::optional<int> FindInColumn(int col, int first_row, int last_row, double key, bool exact) const;
+
+    // Сумма, число, минимум и максимум числовых значений диапазона.
+    // Реализация по умолчанию обходит ячейки диапазона.
+    virtual RangeSummary AggregateRange(const CellRange& range) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
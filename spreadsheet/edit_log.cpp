@@ -0,0 +1,370 @@
+#include "edit_log.h"
+
+#include "binary_format.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Заголовок файла: сигнатура и номер поколения
+const std::string_view LOG_MAGIC = "SSHEETWL";
+const std::string_view SNAPSHOT_MAGIC = "SSHEETSN";
+const size_t HEADER_SIZE = 16;
+
+enum class Op : std::uint8_t {
+    SetCell = 1,
+    ClearCell = 2,
+    ShiftRows = 3,
+    ShiftCols = 4,
+};
+
+std::uint32_t Checksum(std::string_view data) {
+    std::uint32_t hash = 2166136261u;
+    for (char c : data) {
+        hash = (hash ^ static_cast<std::uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+std::string MakeHeader(std::string_view magic, std::uint64_t generation) {
+    std::string header(magic);
+    PutFixed(header, generation, 8);
+    return header;
+}
+
+// Номер поколения из заголовка или false, если заголовка нет
+bool ReadGeneration(std::string_view data, std::string_view magic, std::uint64_t& generation) {
+    if (data.size() < HEADER_SIZE || data.substr(0, magic.size()) != magic) {
+        return false;
+    }
+    generation = GetFixed(data.substr(magic.size()), 8);
+    return true;
+}
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+void SyncFile(std::FILE* file, const std::string& path) {
+    bool ok = std::fflush(file) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(file)) == 0;
+#else
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    if (!ok) {
+        throw std::runtime_error("Failed to sync " + path);
+    }
+}
+
+std::FILE* OpenFile(const std::string& path, const char* mode) {
+    std::FILE* file = std::fopen(path.c_str(), mode);
+    if (file == nullptr) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    return file;
+}
+
+void WriteFile(std::FILE* file, std::string_view data, const std::string& path) {
+    if (std::fwrite(data.data(), 1, data.size(), file) != data.size()) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+void EncodeRecord(std::string& out, std::string_view payload) {
+    PutVarint(out, payload.size());
+    out.append(payload);
+    PutFixed(out, Checksum(payload), 4);
+}
+
+// Извлекает очередную запись; false - записи кончились или последняя оборвана
+bool DecodeRecord(std::string_view& in, std::string_view& payload) {
+    std::string_view rest = in;
+    std::uint64_t size;
+    if (!GetVarint(rest, size) || rest.size() < size + 4) {
+        return false;
+    }
+    payload = rest.substr(0, size);
+    if (Checksum(payload) != GetFixed(rest.substr(size), 4)) {
+        return false;
+    }
+    in = rest.substr(size + 4);
+    return true;
+}
+
+std::string EncodeSetCell(Position pos, std::string_view text) {
+    std::string payload(1, static_cast<char>(Op::SetCell));
+    PutVarint(payload, pos.row);
+    PutVarint(payload, pos.col);
+    PutVarint(payload, text.size());
+    payload.append(text);
+    return payload;
+}
+
+// Повторяет записи журнала. Правки ячеек копятся до ближайшего сдвига строк
+// или столбцов: сдвиг меняет позиции, поэтому перед ним накопленное
+// загружается в лист.
+class Replayer {
+public:
+    explicit Replayer(Sheet& sheet)
+        : sheet_(sheet) {
+    }
+
+    bool Apply(std::string_view payload) {
+        if (payload.empty()) {
+            return false;
+        }
+        auto op = static_cast<Op>(payload.front());
+        payload.remove_prefix(1);
+        std::uint64_t a, b;
+        if (!GetVarint(payload, a) || !GetVarint(payload, b)) {
+            return false;
+        }
+        switch (op) {
+            case Op::SetCell: {
+                std::uint64_t size;
+                if (!GetVarint(payload, size) || payload.size() != size) {
+                    return false;
+                }
+                pending_[Position{static_cast<int>(a), static_cast<int>(b)}] = std::string(payload);
+                return true;
+            }
+            case Op::ClearCell:
+                pending_[Position{static_cast<int>(a), static_cast<int>(b)}].clear();
+                return true;
+            case Op::ShiftRows:
+            case Op::ShiftCols: {
+                Load();
+                // b - смещение в зигзаг-кодировке
+                int first = static_cast<int>(a);
+                int delta = static_cast<int>(b >> 1) * ((b & 1) ? -1 : 1);
+                bool rows = op == Op::ShiftRows;
+                if (delta > 0) {
+                    rows ? sheet_.InsertRows(first, delta) : sheet_.InsertCols(first, delta);
+                } else {
+                    rows ? sheet_.DeleteRows(first, -delta) : sheet_.DeleteCols(first, -delta);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Load() {
+        if (!pending_.empty()) {
+            sheet_.LoadCells({std::make_move_iterator(pending_.begin()),
+                              std::make_move_iterator(pending_.end())});
+            pending_.clear();
+        }
+    }
+
+private:
+    Sheet& sheet_;
+    std::unordered_map<Position, std::string, PositionHasher> pending_;
+};
+
+}  // namespace
+
+EditLog::EditLog(std::string snapshot_path, std::string log_path, size_t group_size,
+                 std::chrono::milliseconds max_delay)
+    : snapshot_path_(std::move(snapshot_path))
+    , log_path_(std::move(log_path))
+    , group_size_(std::max<size_t>(group_size, 1))
+    , max_delay_(max_delay) {
+    std::uint64_t snapshot_generation = 0;
+    std::ifstream snapshot(snapshot_path_, std::ios::binary);
+    std::string header(HEADER_SIZE, '\0');
+    if (snapshot.read(header.data(), HEADER_SIZE)) {
+        ReadGeneration(header, SNAPSHOT_MAGIC, snapshot_generation);
+    }
+
+    std::uint64_t log_generation = 0;
+    std::ifstream log(log_path_, std::ios::binary);
+    if (log.read(header.data(), HEADER_SIZE) && ReadGeneration(header, LOG_MAGIC, log_generation)
+        && log_generation == snapshot_generation) {
+        generation_ = log_generation;
+        file_ = OpenFile(log_path_, "ab");
+    } else {
+        // Журнала нет или он относится к предыдущему снимку
+        ResetLog(snapshot_generation);
+    }
+    flusher_ = std::thread([this] { RunFlusher(); });
+}
+
+EditLog::~EditLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    flusher_.join();
+    try {
+        Flush();
+    } catch (const std::exception&) {
+    }
+    if (file_ != nullptr) {
+        std::fclose(file_);
+    }
+}
+
+void EditLog::AppendSetCell(Position pos, std::string_view text) {
+    AppendRecord(EncodeSetCell(pos, text));
+}
+
+void EditLog::AppendClearCell(Position pos) {
+    std::string payload(1, static_cast<char>(Op::ClearCell));
+    PutVarint(payload, pos.row);
+    PutVarint(payload, pos.col);
+    AppendRecord(payload);
+}
+
+void EditLog::AppendShift(bool rows, int first, int delta) {
+    std::string payload(1, static_cast<char>(rows ? Op::ShiftRows : Op::ShiftCols));
+    PutVarint(payload, first);
+    PutVarint(payload, delta < 0 ? (static_cast<std::uint64_t>(-delta) << 1) | 1
+                                 : static_cast<std::uint64_t>(delta) << 1);
+    AppendRecord(payload);
+}
+
+void EditLog::AppendRecord(const std::string& payload) {
+    std::lock_guard lock(mutex_);
+    if (flush_error_) {
+        std::rethrow_exception(std::exchange(flush_error_, nullptr));
+    }
+    if (pending_.empty()) {
+        pending_since_ = Clock::now();
+        wake_.notify_one();
+    }
+    EncodeRecord(pending_, payload);
+    if (++pending_records_ >= group_size_) {
+        FlushPending();
+    }
+}
+
+void EditLog::Flush() {
+    std::lock_guard lock(mutex_);
+    FlushPending();
+}
+
+void EditLog::FlushPending() {
+    if (flush_error_) {
+        std::rethrow_exception(std::exchange(flush_error_, nullptr));
+    }
+    if (pending_.empty()) {
+        return;
+    }
+    WriteFile(file_, pending_, log_path_);
+    SyncFile(file_, log_path_);
+    pending_.clear();
+    pending_records_ = 0;
+}
+
+void EditLog::RunFlusher() {
+    std::unique_lock lock(mutex_);
+    while (!stop_) {
+        if (pending_.empty() || flush_error_) {
+            wake_.wait(lock);
+            continue;
+        }
+        // Пачку могли сбросить и начать новую, пока поток ждал
+        Clock::time_point deadline = pending_since_ + max_delay_;
+        if (Clock::now() < deadline) {
+            wake_.wait_until(lock, deadline);
+            continue;
+        }
+        try {
+            FlushPending();
+        } catch (...) {
+            flush_error_ = std::current_exception();
+        }
+    }
+}
+
+size_t EditLog::Recover(Sheet& sheet) {
+    std::lock_guard lock(mutex_);
+    EditLog* attached = sheet.GetEditLog();
+    sheet.SetEditLog(nullptr);
+    Replayer replayer(sheet);
+
+    std::string snapshot = ReadFile(snapshot_path_);
+    std::string_view records(snapshot);
+    std::uint64_t generation;
+    if (ReadGeneration(records, SNAPSHOT_MAGIC, generation) && generation == generation_) {
+        records.remove_prefix(HEADER_SIZE);
+        std::string_view payload;
+        while (DecodeRecord(records, payload) && replayer.Apply(payload)) {
+        }
+    }
+
+    FlushPending();
+    std::string log = ReadFile(log_path_);
+    records = std::string_view(log).substr(HEADER_SIZE);
+    size_t replayed = 0;
+    std::string_view payload;
+    while (!records.empty()) {
+        std::string_view rest = records;
+        if (!DecodeRecord(rest, payload) || !replayer.Apply(payload)) {
+            break;
+        }
+        records = rest;
+        ++replayed;
+    }
+    replayer.Load();
+    if (!records.empty()) {
+        // Обрезаем оборванный хвост, чтобы новые записи шли за целыми
+        std::filesystem::resize_file(log_path_, log.size() - records.size());
+    }
+
+    sheet.SetEditLog(attached);
+    return replayed;
+}
+
+void EditLog::Checkpoint(const Sheet& sheet) {
+    std::lock_guard lock(mutex_);
+    FlushPending();
+    std::string snapshot = MakeHeader(SNAPSHOT_MAGIC, generation_ + 1);
+    sheet.ForEachCell([&snapshot](Position pos, const CellInterface& cell) {
+        EncodeRecord(snapshot, EncodeSetCell(pos, cell.GetText()));
+    });
+
+    // Снимок подменяется атомарно: при сбое остаётся либо старый, либо новый
+    std::string tmp_path = snapshot_path_ + ".tmp";
+    std::FILE* file = OpenFile(tmp_path, "wb");
+    try {
+        WriteFile(file, snapshot, tmp_path);
+        SyncFile(file, tmp_path);
+    } catch (...) {
+        std::fclose(file);
+        throw;
+    }
+    std::fclose(file);
+    std::filesystem::rename(tmp_path, snapshot_path_);
+    ResetLog(generation_ + 1);
+}
+
+void EditLog::ResetLog(std::uint64_t generation) {
+    if (file_ != nullptr) {
+        std::fclose(file_);
+    }
+    file_ = OpenFile(log_path_, "wb");
+    WriteFile(file_, MakeHeader(LOG_MAGIC, generation), log_path_);
+    SyncFile(file_, log_path_);
+    std::fclose(file_);
+    file_ = OpenFile(log_path_, "ab");
+    generation_ = generation;
+}
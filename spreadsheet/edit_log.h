@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+class Sheet;
+
+// Журнал упреждающей записи (write-ahead log) для одного листа. Каждая правка
+// дописывается в конец файла журнала компактной двоичной записью с
+// контрольной суммой. Записи копятся в памяти и сбрасываются на диск пачками
+// по group_size с одним fsync на пачку (group commit); Flush сбрасывает их
+// немедленно. Неполную пачку фоновый поток сбрасывает не позже чем через
+// max_delay после её первой записи, так что при сбое теряются правки не
+// больше чем за max_delay (и не больше group_size - 1 правок).
+//
+// Checkpoint записывает снимок листа в отдельный файл и очищает журнал.
+// Снимок и журнал помечены номером поколения: если сбой произошёл между
+// записью снимка и очисткой журнала, устаревший журнал при восстановлении
+// пропускается.
+//
+// Порядок работы:
+//     EditLog log(snapshot_path, log_path);
+//     log.Recover(sheet);
+//     sheet.SetEditLog(&log);
+class EditLog {
+public:
+    static const size_t DEFAULT_GROUP_SIZE = 64;
+    static constexpr std::chrono::milliseconds DEFAULT_MAX_DELAY{100};
+
+    // Открывает (или создаёт) журнал. Ошибки ввода-вывода бросают
+    // std::runtime_error; ошибка фонового сброса бросается из следующего
+    // вызова, пишущего в журнал.
+    EditLog(std::string snapshot_path, std::string log_path, size_t group_size = DEFAULT_GROUP_SIZE,
+            std::chrono::milliseconds max_delay = DEFAULT_MAX_DELAY);
+    ~EditLog();
+
+    EditLog(const EditLog&) = delete;
+    EditLog& operator=(const EditLog&) = delete;
+
+    void AppendSetCell(Position pos, std::string_view text);
+    void AppendClearCell(Position pos);
+    // delta > 0 - вставка delta строк (столбцов) перед first, delta < 0 -
+    // удаление -delta строк (столбцов), начиная с first
+    void AppendShift(bool rows, int first, int delta);
+    // Записывает накопленные записи и дожидается их попадания на диск
+    void Flush();
+
+    // Загружает в лист снимок и повторяет записи журнала. Правки ячеек между
+    // сдвигами строк и столбцов сводятся к последнему значению каждой ячейки и
+    // вставляются пачкой без повторной проверки на циклы: при записи они уже
+    // были проверены. Оборванная при сбое последняя запись отбрасывается.
+    // Возвращает число повторённых записей журнала.
+    size_t Recover(Sheet& sheet);
+    // Сохраняет снимок листа и очищает журнал
+    void Checkpoint(const Sheet& sheet);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void AppendRecord(const std::string& payload);
+    // Вызываются под mutex_
+    void FlushPending();
+    void ResetLog(std::uint64_t generation);
+    // Фоновый поток: сбрасывает неполную пачку по истечении max_delay_
+    void RunFlusher();
+
+    std::string snapshot_path_;
+    std::string log_path_;
+    size_t group_size_;
+    std::chrono::milliseconds max_delay_;
+    std::FILE* file_ = nullptr;
+    std::uint64_t generation_ = 0;
+    std::string pending_;
+    size_t pending_records_ = 0;
+    // Время первой записи в pending_
+    Clock::time_point pending_since_;
+    std::exception_ptr flush_error_;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread flusher_;
+};
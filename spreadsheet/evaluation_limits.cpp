@@ -0,0 +1,40 @@
+#include "evaluation_limits.h"
+
+namespace {
+thread_local const EvaluationLimits* active_limits = nullptr;
+// Вызовов до следующей проверки часов
+thread_local unsigned deadline_countdown = 0;
+}
+
+EvaluationLimitScope::EvaluationLimitScope(const EvaluationLimits& limits)
+    : previous_(active_limits)
+    , previous_countdown_(deadline_countdown) {
+    active_limits = &limits;
+    // Первая же проверка смотрит на часы: срок мог истечь до начала
+    deadline_countdown = 0;
+}
+
+EvaluationLimitScope::~EvaluationLimitScope() {
+    active_limits = previous_;
+    deadline_countdown = previous_countdown_;
+}
+
+void CheckEvaluationLimits() {
+    if (active_limits == nullptr) {
+        return;
+    }
+    if (active_limits->cancel != nullptr && active_limits->cancel->IsCancelled()) {
+        throw EvaluationInterrupted();
+    }
+    if (!active_limits->deadline) {
+        return;
+    }
+    if (deadline_countdown > 0) {
+        --deadline_countdown;
+        return;
+    }
+    deadline_countdown = DEADLINE_CHECK_INTERVAL - 1;
+    if (std::chrono::steady_clock::now() >= *active_limits->deadline) {
+        throw EvaluationInterrupted();
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+
+// Флаг отмены вычислений. Отменять можно из любого потока.
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+    bool IsCancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
+// Ограничения вычислений: срок и/или флаг отмены
+struct EvaluationLimits {
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    const CancellationToken* cancel = nullptr;
+
+    static EvaluationLimits Timeout(std::chrono::steady_clock::duration timeout) {
+        return {std::chrono::steady_clock::now() + timeout, nullptr};
+    }
+};
+
+// Прерывает вычисление при исчерпании ограничений. Не является ошибкой
+// формулы: недовычисленные ячейки не кэшируют значение и вычисляются заново
+// при следующем обращении.
+class EvaluationInterrupted : public std::runtime_error {
+public:
+    EvaluationInterrupted()
+        : std::runtime_error("evaluation interrupted") {
+    }
+};
+
+enum class EvaluationStatus {
+    Complete,
+    // Вычисление прервано; уже вычисленные ячейки сохраняют значения
+    Partial,
+};
+
+struct EvaluationResult {
+    EvaluationStatus status = EvaluationStatus::Complete;
+    // Заполнено только при status == Complete
+    CellInterface::Value value;
+};
+
+// Ограничения действуют на вычисления в этом потоке, пока объект существует.
+// Вложенная область заменяет внешнюю до своего разрушения.
+class EvaluationLimitScope {
+public:
+    explicit EvaluationLimitScope(const EvaluationLimits& limits);
+    ~EvaluationLimitScope();
+
+    EvaluationLimitScope(const EvaluationLimitScope&) = delete;
+    EvaluationLimitScope& operator=(const EvaluationLimitScope&) = delete;
+
+private:
+    const EvaluationLimits* previous_;
+    unsigned previous_countdown_;
+};
+
+// Бросает EvaluationInterrupted, если ограничения области этого потока
+// исчерпаны. Флаг отмены проверяется при каждом вызове, часы - раз в
+// DEADLINE_CHECK_INTERVAL вызовов, так что проверка дешёвая и вызывается при
+// вычислении каждой формулы.
+void CheckEvaluationLimits();
+
+inline constexpr unsigned DEADLINE_CHECK_INTERVAL = 64;
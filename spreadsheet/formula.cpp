@@ -1,11 +1,15 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "evaluation_limits.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 using namespace std::literals;
 
@@ -50,6 +54,8 @@ public:
             output = ast_.Execute(sheet);
         } catch(const FormulaError& e) {
             return e;
+        } catch(const EvaluationInterrupted&) {
+            throw;
         } catch(...){
             throw FormulaException("");
         }
@@ -62,10 +68,55 @@ public:
         return out.str();
     }
 
-    std::vector<Position> GetReferencedCells() const {
+    Span<Position> GetReferencedCellsView() const override {
         return ast_.GetReferencedCells();
     }
 
+    Span<CellRange> GetReferencedRangesView() const override {
+        return ast_.GetReferencedRanges();
+    }
+
+    bool CompileColumnKernel(Position origin, ColumnKernel& kernel) const override {
+        return ast_.CompileColumnKernel(kernel, origin);
+    }
+
+    void ShiftReferences(const std::function<Position(Position)>& shift) override {
+        ast_.ShiftReferences(shift);
+    }
+
+    Span<SheetPosition> GetExternalReferencedCellsView() const override {
+        return ast_.GetExternalReferencedCells();
+    }
+
+    void ShiftExternalReferences(std::string_view sheet,
+                                 const std::function<Position(Position)>& shift) override {
+        ast_.ShiftExternalReferences(sheet, shift);
+    }
+
+    size_t GetAstMemoryUsage() const override {
+        return sizeof(*this) + ast_.GetMemoryUsage();
+    }
+
+    size_t GetEvalTreeMemoryUsage() const override {
+        return ast_.GetEvalTreeMemoryUsage();
+    }
+
+    void ReleaseEvalTree() override {
+        ast_.ReleaseEvalTree();
+    }
+
+    void ForEachSubexpression(const std::function<void(const std::string&)>& visit) const override {
+        ast_.ForEachSubexpression(visit);
+    }
+
+    void ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup) override {
+        ast_.ShareSubexpressions(lookup);
+    }
+
+    void UnshareSubexpressions() override {
+        ast_.UnshareSubexpressions();
+    }
+
 private:
     FormulaAST ast_;
 };
@@ -73,4 +124,49 @@ private:
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+// Потоки берут выражения блоками по PARSE_BLOCK, у каждого потока свой
+// контекст разбора (см. ParseFormulaAST)
+std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(const std::vector<std::string>& expressions,
+                                                             size_t max_threads) {
+    const size_t PARSE_BLOCK = 256;
+    std::vector<std::unique_ptr<FormulaInterface>> result(expressions.size());
+    const size_t blocks = (expressions.size() + PARSE_BLOCK - 1) / PARSE_BLOCK;
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::atomic<size_t> next{0};
+    std::mutex error_mutex;
+    size_t error_index = expressions.size();
+    std::exception_ptr error;
+    auto worker = [&]() {
+        for (size_t block = next++; block < blocks; block = next++) {
+            size_t last = std::min(expressions.size(), (block + 1) * PARSE_BLOCK);
+            for (size_t i = block * PARSE_BLOCK; i < last; ++i) {
+                try {
+                    result[i] = ParseFormula(expressions[i]);
+                } catch (...) {
+                    std::lock_guard lock(error_mutex);
+                    if (i < error_index) {
+                        error_index = i;
+                        error = std::current_exception();
+                    }
+                    break;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(max_threads, blocks); ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
 }
\ No newline at end of file
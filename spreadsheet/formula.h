@@ -1,7 +1,9 @@
 #pragma once
 
+#include "column_kernel.h"
 #include "common.h"
 
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -9,6 +11,7 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции, в том числе поиска по диапазонам: MATCH(5,A1:A100,0)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -32,10 +35,66 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. Список строится при разборе формулы, View возвращает его без
+    // копирования.
+    virtual Span<Position> GetReferencedCellsView() const = 0;
+    std::vector<Position> GetReferencedCells() const {
+        return GetReferencedCellsView().ToVector();
+    }
+
+    // Диапазоны ячеек своего листа (A1:B10), отсортированные и без повторов.
+    // Ячейки диапазонов не входят в GetReferencedCells. Диапазоны, ставшие
+    // некорректными при удалении строк или столбцов, не возвращаются.
+    virtual Span<CellRange> GetReferencedRangesView() const = 0;
+
+    // Строит ядро формулы для вычисления по столбцу (см. ColumnKernel), считая,
+    // что формула записана в ячейке origin. Возвращает false, если формулу
+    // нельзя вычислить ядром.
+    virtual bool CompileColumnKernel(Position origin, ColumnKernel& kernel) const = 0;
+
+    // Заменяет каждую ссылку pos на shift(pos) без повторного разбора формулы.
+    // Ссылки, ставшие некорректными, вычисляются и печатаются как #REF!;
+    // напечатанный текст разбирается обратно в ту же формулу.
+    virtual void ShiftReferences(const std::function<Position(Position)>& shift) = 0;
+
+    // То же для ссылок на другие листы: возвращает отсортированный список без
+    // повторов и сдвигает ссылки на лист sheet.
+    virtual Span<SheetPosition> GetExternalReferencedCellsView() const = 0;
+    std::vector<SheetPosition> GetExternalReferencedCells() const {
+        return GetExternalReferencedCellsView().ToVector();
+    }
+    virtual void ShiftExternalReferences(std::string_view sheet,
+                                         const std::function<Position(Position)>& shift) = 0;
+
+    // Память, занятая формулой вне объекта ячейки, в байтах: дерево разбора
+    // со списками ссылок и упрощённое дерево для вычисления. Упрощённое
+    // дерево можно освободить, тогда оно строится заново при следующем
+    // вычислении формулы.
+    virtual size_t GetAstMemoryUsage() const = 0;
+    virtual size_t GetEvalTreeMemoryUsage() const = 0;
+    virtual void ReleaseEvalTree() = 0;
+
+    // Общие подвыражения (см. Sheet::ShareCommonSubexpressions). Перечисляет
+    // подвыражения, которые можно вычислить отдельно от формулы: операции и
+    // вызовы функций, ссылающиеся только на ячейки своего листа, без
+    // диапазонов. Подвыражение передаётся каноничным текстом; разбор текста
+    // даёт то же выражение.
+    virtual void ForEachSubexpression(const std::function<void(const std::string&)>& visit) const = 0;
+    // Заменяет в упрощённом дереве подвыражения, для которых lookup
+    // возвращает ячейку, чтением значения этой ячейки. Замена идёт сверху
+    // вниз: внутри заменённого подвыражения lookup не вызывается. Печать
+    // формулы и списки ссылок не меняются.
+    virtual void ShareSubexpressions(const std::function<const CellInterface*(const std::string&)>& lookup) = 0;
+    // Возвращает упрощённое дерево без общих подвыражений
+    virtual void UnshareSubexpressions() = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Разбирает пачку выражений в max_threads потоках (0 - по числу ядер).
+// Результат i соответствует expressions[i]. Если некорректных выражений
+// несколько, FormulaException бросается для первого из них.
+std::vector<std::unique_ptr<FormulaInterface>> ParseFormulas(const std::vector<std::string>& expressions,
+                                                             size_t max_threads = 0);
\ No newline at end of file
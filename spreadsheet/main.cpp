@@ -1,8 +1,20 @@
+#include <filesystem>
+#include <fstream>
+#include <atomic>
 #include <limits>
+#include <thread>
 
+#include "async_sheet.h"
 #include "common.h"
+#include "edit_log.h"
+#include "evaluation_limits.h"
 #include "formula.h"
+#include "operation_trace.h"
+#include "range_index.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "trace.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -203,6 +215,31 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaConstantFolding() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    auto evaluate = [&](std::string expr) {
+        return ParseFormula(std::move(expr))->Evaluate(*sheet);
+    };
+    const FormulaInterface::Value arithm = FormulaError::Category::Arithmetic;
+
+    auto formula = ParseFormula("2*3*A1+0");
+    ASSERT_EQUAL(formula->GetExpression(), "2*3*A1+0");
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 12.0);
+    ASSERT_EQUAL(ParseFormula("+(1*A1)/1-0")->GetExpression(), "+1*A1/1-0");
+    ASSERT_EQUAL(std::get<double>(evaluate("+(1*A1)/1-0")), 2.0);
+    ASSERT_EQUAL(std::get<double>(evaluate("-(2-5)*A1")), 6.0);
+
+    ASSERT(evaluate("A1/(2-2)") == arithm);
+    ASSERT(evaluate("1/0+A1") == arithm);
+    ASSERT(evaluate("A1*(1e200*1e200)") == arithm);
+
+    sheet->SetCell("A1"_pos, "=1/0");
+    ASSERT(evaluate("A1*1") == arithm);
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT(evaluate("A1*1") == FormulaInterface::Value(FormulaError::Category::Value));
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -397,6 +434,1320 @@ void TestSetGetCellCellRef() {
     checkCell("D1"_pos, "=A1 + A1");
 }
 
+void TestChromeTrace() {
+    auto sheet = CreateSheet();
+    Trace::Clear();
+    Trace::Enable(true);
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("A1"_pos, "2");
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    Trace::Enable(false);
+    sheet->SetCell("B1"_pos, "=A2");
+
+    std::ostringstream trace;
+    Trace::WriteChromeTrace(trace);
+    const std::string json = trace.str();
+    ASSERT(json.rfind("{\"traceEvents\":[", 0) == 0);
+    ASSERT(json.find("\"name\":\"ParseFormulaAST\"") != std::string::npos);
+    ASSERT(json.find("\"name\":\"CycleCheck\",\"cat\":\"spreadsheet\",\"ph\":\"X\"") != std::string::npos);
+    ASSERT(json.find("\"args\":{\"cell\":\"A2\"}") != std::string::npos);
+    ASSERT(json.find("\"name\":\"InvalidateCache\"") != std::string::npos);
+    // вычисление формулы помечено ячейкой
+    size_t execute = json.find("\"name\":\"Execute\"");
+    ASSERT(execute != std::string::npos);
+    ASSERT(json.substr(execute, json.find("}}", execute) - execute).find("\"cell\":\"A2\"") != std::string::npos);
+    ASSERT(json.find("\"name\":\"PrintValues\"") != std::string::npos);
+    ASSERT(json.find("\"cell\":\"B1\"") == std::string::npos);
+    Trace::Clear();
+}
+
+void TestProfileReport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.EnableProfiling(true);
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "text");
+
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 3.0);
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 6.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 6.0);
+
+    auto report = sheet.ProfileReport(10);
+    ASSERT_EQUAL(report.size(), 2u);
+    auto a3 = std::find_if(report.begin(), report.end(), [](const auto& entry) {
+        return entry.pos == "A3"_pos;
+    });
+    ASSERT(a3 != report.end());
+    ASSERT_EQUAL(a3->text, "=A2+A1");
+    ASSERT_EQUAL(a3->depth, 2);
+    ASSERT_EQUAL(a3->profile.evaluations, 2u);
+    ASSERT_EQUAL(a3->profile.invalidations, 1u);
+    ASSERT(a3->profile.exclusive <= a3->profile.inclusive);
+    ASSERT(report[0].profile.exclusive >= report[1].profile.exclusive);
+    ASSERT_EQUAL(sheet.ProfileReport(1).size(), 1u);
+
+    sheet.EnableProfiling(false);
+    ASSERT(sheet.ProfileReport(10).empty());
+}
+
+void TestColumnRunEvaluation() {
+    auto fill = [](SheetInterface& sheet) {
+        for (int row = 0; row < 100; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 1}, std::to_string(row * 3));
+            sheet.SetCell({row, 2}, row == 60 ? "0" : std::to_string(row % 7 + 1));
+            sheet.SetCell({row, 3}, row == 50 ? "text" : std::to_string(row));
+            sheet.SetCell({row, 4}, "=B" + r + "*C" + r + "-D" + r + "/C" + r);
+            sheet.SetCell({row, 5}, "=-E" + r + "*2+1");
+        }
+        sheet.SetCell({70, 3}, "=1/0");
+        sheet.SetCell({80, 4}, "=B81+1");
+    };
+
+    Sheet scalar;
+    fill(scalar);
+    for (int row = 0; row < 100; ++row) {
+        scalar.GetCell({row, 4})->GetValue();
+        scalar.GetCell({row, 5})->GetValue();
+    }
+    std::ostringstream expected;
+    scalar.PrintValues(expected);
+
+    Sheet vectorised;
+    fill(vectorised);
+    std::ostringstream values;
+    vectorised.PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected.str());
+    ASSERT_EQUAL(vectorised.GetCell("E51"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(vectorised.GetCell("E61"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(vectorised.GetCell("F71"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(std::get<double>(vectorised.GetCell("E10"_pos)->GetValue()), 27.0 * 3 - 9.0 / 3);
+}
+
+void TestInsertDeleteRowsCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A2*A3");
+    sheet.SetCell("B3"_pos, "=A3+C1");
+    sheet.SetCell("C5"_pos, "=B1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 7.0);
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+A4*A5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 7.0);
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=A5+C1");
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), "=B1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "A4"_pos, "A5"_pos}));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{7, 3}));
+
+    // зависимости переехали вместе с ячейками
+    sheet.SetCell("A4"_pos, "10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C7"_pos)->GetValue()), 31.0);
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1+B4*B5");
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B5+D1");
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+A4*A5");
+
+    sheet.DeleteRows(3);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+#REF!*A4");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "A4"_pos}));
+
+    sheet.DeleteRows(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=#REF!");
+    sheet.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Ref));
+
+    sheet.SetCell(Position{Position::MAX_ROWS - 1, 0}, "edge");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2+#REF!");
+
+    // текст со сломанными ссылками снова разбирается в ту же формулу
+    sheet.SetCell("E1"_pos, "=MATCH(1,A7:A8,0)+SUM(A7:A8)");
+    sheet.DeleteRows(6, 2);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=MATCH(1,#REF!,0)+SUM(#REF!)");
+    for (auto pos : {"B2"_pos, "C4"_pos, "E1"_pos}) {
+        std::string text = sheet.GetCell(pos)->GetText();
+        sheet.SetCell("F1"_pos, text);
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), text);
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(),
+                        CellInterface::Value(FormulaError::Category::Ref));
+    }
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetReferencedCells(), std::vector<Position>{});
+}
+
+void TestCanonicalFormulaText() {
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "= ( A1 ) + B2*(3)");
+    sheet.SetCell("A3"_pos, "1");
+    auto cell = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos));
+    };
+    // текст строится один раз при разборе и не копируется при чтении
+    ASSERT_EQUAL(cell("C1"_pos)->GetText(), "=A1+B2*3");
+    ASSERT_EQUAL(cell("C1"_pos)->GetTextView().data(), cell("C1"_pos)->GetTextView().data());
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\t=A1+B2*3\n\t\t\n1\t\t\n");
+
+    // сдвиги переписывают ссылки и обновляют текст
+    sheet.InsertRows(1);
+    ASSERT_EQUAL(cell("C1"_pos)->GetText(), "=A1+B3*3");
+    sheet.InsertCols(0, 2);
+    ASSERT_EQUAL(cell("E1"_pos)->GetText(), "=C1+D3*3");
+    sheet.DeleteRows(2);
+    ASSERT_EQUAL(cell("E1"_pos)->GetTextView(), "=C1+#REF!*3");
+    texts.str("");
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\t\t\t=C1+#REF!*3\n\t\t\t\t\n\t\t1\t\t\n");
+}
+
+void TestWorkbookCrossSheetReferences() {
+    Workbook book;
+    Sheet& prices = book.AddSheet("Prices");
+    Sheet& totals = book.AddSheet("Totals");
+
+    prices.SetCell("A1"_pos, "10");
+    prices.SetCell("A2"_pos, "=A1*2");
+    totals.SetCell("B1"_pos, "=Prices!A2+Prices!A1");
+    totals.SetCell("B2"_pos, "='My Rates'!A1*B1");
+    totals.SetCell("B3"_pos, "=Totals!B1");
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetText(), "=Prices!A2+Prices!A1");
+    ASSERT_EQUAL(totals.GetCell("B2"_pos)->GetText(), "='My Rates'!A1*B1");
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("B1"_pos)->GetValue()), 30.0);
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("B3"_pos)->GetValue()), 30.0);
+    ASSERT_EQUAL(totals.GetCell("B2"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(totals.GetCell("B1"_pos)->GetReferencedCells().empty());
+
+    // изменение на одном листе сбрасывает кэш зависимых формул другого
+    prices.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("B1"_pos)->GetValue()), 3.0);
+
+    Sheet& rates = book.AddSheet("My Rates");
+    rates.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("B2"_pos)->GetValue()), 12.0);
+
+    bool caught = false;
+    try {
+        prices.SetCell("A1"_pos, "=Totals!B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(prices.GetCell("A1"_pos)->GetText(), "1");
+
+    prices.InsertRows(0);
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetText(), "=Prices!A3+Prices!A2");
+    prices.DeleteRows(1);
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetText(), "=Prices!A2+#REF!");
+
+    // ячейки в журнале отмены другого листа тоже получают сдвинутые ссылки
+    totals.SetCell("C1"_pos, "=Prices!A5");
+    totals.SetCell("C1"_pos, "=Prices!A6+1");
+    prices.InsertRows(0);
+    ASSERT_EQUAL(totals.GetCell("C1"_pos)->GetText(), "=Prices!A7+1");
+    ASSERT(totals.Undo());
+    ASSERT_EQUAL(totals.GetCell("C1"_pos)->GetText(), "=Prices!A6");
+    prices.DeleteRows(0, 2);
+    ASSERT_EQUAL(totals.GetCell("C1"_pos)->GetText(), "=Prices!A4");
+    ASSERT(totals.Redo());
+    ASSERT_EQUAL(totals.GetCell("C1"_pos)->GetText(), "=Prices!A5+1");
+    prices.SetCell("A5"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("C1"_pos)->GetValue()), 4.0);
+
+    try {
+        book.AddSheet("Prices");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{"Prices", "Totals", "My Rates"}));
+}
+
+void TestWorkbookParallelRecalculation() {
+    Workbook book;
+    const int sheets = 6;
+    const int rows = 200;
+    for (int s = 0; s < sheets; ++s) {
+        Sheet& sheet = book.AddSheet("S" + std::to_string(s));
+        for (int row = 0; row < rows; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row + s));
+            // листы S3..S5 зависят от S0..S2, S0..S2 независимы
+            sheet.SetCell({row, 1}, s < 3 ? "=A" + r + "*2" : "=S" + std::to_string(s - 3) + "!B" + r + "+A" + r);
+        }
+    }
+    book.Recalculate(4);
+    for (int s = 0; s < sheets; ++s) {
+        const Sheet& sheet = *book.GetSheet("S" + std::to_string(s));
+        for (int row = 0; row < rows; ++row) {
+            double expected = s < 3 ? (row + s) * 2.0 : (row + s - 3) * 2.0 + row + s;
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell({row, 1})->GetValue()), expected);
+        }
+    }
+}
+
+void TestUndoRedoJournal() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1*10");
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 20.0);
+
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 10.0);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 20.0);
+
+    // вставка диапазона отменяется одной операцией
+    sheet.BeginTransaction();
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 2}, std::to_string(row));
+    }
+    sheet.ClearCell("A1"_pos);
+    sheet.CommitTransaction();
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{100, 3}));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 0.0);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 1}));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 20.0);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetText(), "99");
+    ASSERT(!sheet.Redo());
+
+    // новая правка сбрасывает возможность повтора
+    ASSERT(sheet.Undo());
+    sheet.SetCell("B1"_pos, "x");
+    ASSERT(!sheet.CanRedo());
+
+    // журнал ограничен: старые правки вытесняются
+    sheet.SetJournalLimit(3);
+    for (int i = 0; i < 5; ++i) {
+        sheet.SetCell("D1"_pos, std::to_string(i));
+    }
+    ASSERT(sheet.Undo() && sheet.Undo() && sheet.Undo());
+    ASSERT(!sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "1");
+
+    sheet.SetJournalLimit(0);
+    sheet.SetCell("D1"_pos, "5");
+    ASSERT(!sheet.CanUndo());
+
+    // отмена внутри транзакции завершает её: следующие правки идут отдельно
+    Sheet open;
+    open.SetCell("A1"_pos, "1");
+    open.BeginTransaction();
+    open.SetCell("A2"_pos, "2");
+    ASSERT(open.Undo());
+    open.SetCell("A3"_pos, "3");
+    ASSERT(open.Undo());
+    ASSERT(open.GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(open.GetCell("A1"_pos)->GetText(), "1");
+    open.CommitTransaction();
+
+    Sheet first;
+    first.BeginTransaction();
+    first.SetCell("A1"_pos, "1");
+    ASSERT(first.Undo());
+    first.SetCell("A1"_pos, "2");
+    ASSERT(first.Undo());
+    ASSERT(first.GetCell("A1"_pos) == nullptr);
+    ASSERT(!first.CanUndo());
+}
+
+void TestMemoryBudget() {
+    Sheet sheet;
+    const int rows = 200;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, "value " + std::string(40, 'x'));
+        sheet.SetCell({row, 1}, std::to_string(row));
+        sheet.SetCell({row, 2}, "=B" + std::to_string(row + 1) + "*(2+3)");
+    }
+    sheet.Recalculate();
+    auto usage = sheet.MemoryUsage();
+    ASSERT(usage.storage > 0 && usage.cells > 0 && usage.text > 0);
+    ASSERT(usage.ast > 0 && usage.cache > 0 && usage.dependencies > 0);
+
+    sheet.SetMemoryBudget(usage.Total() - 1);
+    ASSERT(sheet.MemoryUsage().Total() < usage.Total());
+
+    // ячейки, прочитанные после прошлого обхода, сбрасываются последними
+    for (int row = 0; row < 10; ++row) {
+        sheet.GetCell({row, 2})->GetValue();
+    }
+    const size_t budget = usage.Total() - usage.cache / 2;
+    sheet.SetMemoryBudget(budget);
+    auto trimmed = sheet.MemoryUsage();
+    ASSERT(trimmed.Total() <= budget);
+    ASSERT_EQUAL(trimmed.ast, usage.ast);
+    for (int row = 0; row < 10; ++row) {
+        ASSERT(static_cast<const Cell*>(sheet.GetCell({row, 2}))->HasCachedValue());
+    }
+    for (int row = 0; row < rows; ++row) {
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell({row, 2})->GetValue()), row * 5.0);
+    }
+    ASSERT(sheet.MemoryUsage().cache > trimmed.cache);
+    // вычисление заново строит освобождённые упрощённые деревья
+    ASSERT_EQUAL(sheet.MemoryUsage().cache, usage.cache);
+}
+
+void TestEmptyReferencedPositions() {
+    Sheet sheet;
+    // ячейки в журнале отмены тоже учитываются в MemoryUsage
+    sheet.SetJournalLimit(0);
+    std::string formula = "=1";
+    for (int row = 0; row < 1000; ++row) {
+        formula += "+Z" + std::to_string(row + 1);
+    }
+    sheet.SetCell("A1"_pos, formula);
+    Sheet reference;
+    reference.SetCell("A1"_pos, "=1");
+    // пустые позиции, на которые ссылается формула, не создают ячеек
+    ASSERT_EQUAL(sheet.MemoryUsage().cells, reference.MemoryUsage().cells);
+    ASSERT(sheet.GetCell("Z10"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("Z10"_pos)->GetText(), "");
+    ASSERT(sheet.GetCell("Y10"_pos) == nullptr);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 1.0);
+
+    sheet.SetCell("Z5"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 3.0);
+    sheet.ClearCell("Z5"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(sheet.MemoryUsage().cells, reference.MemoryUsage().cells);
+
+    sheet.InsertRows(0);
+    sheet.SetCell("Z6"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 5.0);
+    sheet.DeleteRows(2);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Ref));
+
+    try {
+        sheet.SetCell("Z3"_pos, "=A2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestReferencedCellsView() {
+    auto formula = ParseFormula("B2+A1*B2-A1+C1/A1");
+    auto refs = formula->GetReferencedCellsView();
+    ASSERT_EQUAL(refs.ToVector(), (std::vector{"A1"_pos, "C1"_pos, "B2"_pos}));
+    // список не строится заново при каждом обращении
+    ASSERT(formula->GetReferencedCellsView().begin() == refs.begin());
+
+    formula->ShiftReferences([](Position pos) {
+        return pos.col == 2 ? Position::NONE : Position{pos.row + 1, pos.col};
+    });
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A2"_pos, "B3"_pos}));
+}
+
+void TestFormulaFunctions() {
+    auto expression = [](std::string text) {
+        return ParseFormula(std::move(text))->GetExpression();
+    };
+    ASSERT_EQUAL(expression("ROUND( A1 * 2.5 , 1 )"), "ROUND(A1*2.5,1)");
+    ASSERT_EQUAL(expression("(1<2)+MAX((A1+1),2,-B2)"), "(1<2)+MAX(A1+1,2,-B2)");
+    ASSERT_EQUAL(expression("(1<2)<=3"), "1<2<=3");
+    ASSERT_EQUAL(expression("1<>(2>=3)"), "1<>(2>=3)");
+    ASSERT_EQUAL(expression("IF(A1=2,3)"), "IF(A1=2,3)");
+    for (auto text : {"FOO(1)", "ABS(1,2)", "IF(1)", "MIN()", "ABS"}) {
+        try {
+            ParseFormula(text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=-2.5");
+    sheet.SetCell("A2"_pos, "=ROUND(A1)+ROUND(1234,-2)+ROUND(0.125,2)");
+    sheet.SetCell("A3"_pos, "=ABS(A1)*MIN(4,A1,3,2)+MAX(A1,1)");
+    sheet.SetCell("A4"_pos, "=(A1<0)+(A1>=0)*10+(A1<>A1)*100");
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    ASSERT_EQUAL(std::get<double>(value("A2"_pos)), -3.0 + 1200.0 + 0.13);
+    ASSERT_EQUAL(std::get<double>(value("A3"_pos)), 2.5 * -2.5 + 1.0);
+    ASSERT_EQUAL(std::get<double>(value("A4"_pos)), 1.0);
+
+    // невыбранная ветвь IF не вычисляется
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=IF(A1<0,7,B1+1/0)");
+    ASSERT_EQUAL(std::get<double>(value("B2"_pos)), 7.0);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("B1"_pos))->HasCachedValue());
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet.SetCell("B3"_pos, "=IF(B1,ABS(1/0))");
+    ASSERT_EQUAL(value("B3"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
+void TestLookupFunctions() {
+    Sheet sheet;
+    const int rows = 2000;
+    for (int i = 0; i < rows; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i * 2));
+        sheet.SetCell({i, 1}, std::to_string(i * 10));
+    }
+    sheet.SetCell("C1"_pos, "=MATCH(10,A1:A2000,0)");
+    sheet.SetCell("C2"_pos, "=MATCH(11,A1:A2000)");
+    sheet.SetCell("C3"_pos, "=VLOOKUP(10,A1:B2000,2,0)");
+    sheet.SetCell("C4"_pos, "=XLOOKUP(11,A1:A2000,B1:B2000,-1)");
+    sheet.SetCell("C5"_pos, "=A1:A3");
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto number = [&value](Position pos) {
+        return std::get<double>(value(pos));
+    };
+    const CellInterface::Value not_found = FormulaError::Category::Value;
+    ASSERT_EQUAL(number("C1"_pos), 6.0);
+    ASSERT_EQUAL(number("C2"_pos), 6.0);
+    ASSERT_EQUAL(number("C3"_pos), 50.0);
+    ASSERT_EQUAL(number("C4"_pos), -1.0);
+    ASSERT_EQUAL(value("C5"_pos), not_found);
+
+    // индексы обновляются при изменении и очистке ячеек столбца
+    sheet.SetCell("A6"_pos, "7");
+    ASSERT_EQUAL(value("C1"_pos), not_found);
+    ASSERT_EQUAL(number("C2"_pos), 5.0);
+    sheet.SetCell("A100"_pos, "10");
+    ASSERT_EQUAL(number("C1"_pos), 100.0);
+    ASSERT_EQUAL(number("C3"_pos), 990.0);
+    sheet.ClearCell("A100"_pos);
+    ASSERT_EQUAL(value("C1"_pos), not_found);
+
+    // формула в столбце переиндексируется при изменении её входов
+    sheet.SetCell("D1"_pos, "10");
+    sheet.SetCell("A1500"_pos, "=D1");
+    ASSERT_EQUAL(number("C1"_pos), 1500.0);
+    sheet.SetCell("D1"_pos, "3");
+    ASSERT_EQUAL(value("C1"_pos), not_found);
+    for (auto [pos, text] : {std::pair{"A2"_pos, "=MATCH(1,A1:A10,0)"}, {"D1"_pos, "=C1"}}) {
+        try {
+            sheet.SetCell(pos, text);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    try {
+        sheet.SetCell("C6"_pos, "=MATCH(1,2)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // результаты поиска по индексам совпадают с просмотром столбца
+    sheet.SetCell("A10"_pos, "4");
+    unsigned seed = 1;
+    for (int i = 0; i < 500; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        double key = (seed >> 8) % 4100;
+        int first = (seed >> 4) % 100;
+        int last = first + (seed >> 12) % 2000;
+        for (bool exact : {true, false}) {
+            ASSERT_EQUAL(sheet.FindInColumn(0, first, last, key, exact).value_or(-1),
+                         sheet.SheetInterface::FindInColumn(0, first, last, key, exact).value_or(-1));
+        }
+    }
+
+    // вставка строки сдвигает диапазон, удаление строк с его углом сужает его
+    sheet.SetCell("E50"_pos, "=MATCH(11,A1:A2000)");
+    ASSERT_EQUAL(number("E50"_pos), 5.0);
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("E51"_pos)->GetText(), "=MATCH(11,A2:A2001)");
+    ASSERT_EQUAL(number("E51"_pos), 5.0);
+    sheet.DeleteRows(1, 3);
+    ASSERT_EQUAL(sheet.GetCell("E48"_pos)->GetText(), "=MATCH(11,A2:A1998)");
+    ASSERT_EQUAL(number("E48"_pos), 2.0);
+
+    // поиск в том же столбце, что и диапазон, и формулы вне диапазона,
+    // зависящие от поиска: индексируются только строки диапазона
+    Sheet column;
+    for (int i = 0; i < 10; ++i) {
+        column.SetCell({i, 0}, std::to_string(i));
+    }
+    column.SetCell("A100"_pos, "=MATCH(5,A1:A10,0)");
+    column.SetCell("B1"_pos, "=MATCH(5,A1:A10,0)");
+    column.SetCell("A20"_pos, "=B1*2");
+    column.SetCell("A30"_pos, "=A1+1");
+    ASSERT_EQUAL(std::get<double>(column.GetCell("A100"_pos)->GetValue()), 6.0);
+    ASSERT_EQUAL(std::get<double>(column.GetCell("A20"_pos)->GetValue()), 12.0);
+    ASSERT(!dynamic_cast<const Cell*>(column.GetCell("A30"_pos))->HasCachedValue());
+    column.SetCell("A3"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(column.GetCell("A100"_pos)->GetValue()), 3.0);
+    ASSERT_EQUAL(std::get<double>(column.GetCell("A20"_pos)->GetValue()), 6.0);
+    ASSERT_EQUAL(column.FindInColumn(0, 10, 99, 1.0, true).value_or(-1), 29);
+}
+
+void TestRangeAggregates() {
+    Sheet sheet;
+    for (int i = 0; i < 1000; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i));
+    }
+    sheet.SetCell("C1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("C2"_pos, "=COUNT(A1:B1000)");
+    sheet.SetCell("C3"_pos, "=AVERAGE(A1:A10)");
+    sheet.SetCell("C4"_pos, "=MIN(A5:A10,100)");
+    sheet.SetCell("C5"_pos, "=MAX(A1:A1000)");
+    sheet.SetCell("C6"_pos, "=SUM(A1:A3,10)");
+    sheet.SetCell("C7"_pos, "=AVERAGE(D1:D5)");
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto number = [&value](Position pos) {
+        return std::get<double>(value(pos));
+    };
+    ASSERT_EQUAL(number("C1"_pos), 499500.0);
+    ASSERT_EQUAL(number("C2"_pos), 1000.0);
+    ASSERT_EQUAL(number("C3"_pos), 4.5);
+    ASSERT_EQUAL(number("C4"_pos), 4.0);
+    ASSERT_EQUAL(number("C5"_pos), 999.0);
+    ASSERT_EQUAL(number("C6"_pos), 13.0);
+    ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    // правки пересчитывают агрегаты, текст пропускается, ошибки передаются
+    sheet.SetCell("A1"_pos, "1000");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("B7"_pos, "7");
+    ASSERT_EQUAL(number("C1"_pos), 499500.0 + 1000.0 - 1.0);
+    ASSERT_EQUAL(number("C2"_pos), 1000.0);
+    ASSERT_EQUAL(number("C5"_pos), 1000.0);
+    ASSERT_EQUAL(number("C6"_pos), 1012.0);
+    sheet.SetCell("E1"_pos, "=1/0");
+    sheet.SetCell("A3"_pos, "=E1");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(number("C2"_pos), 999.0);
+    sheet.SetCell("E1"_pos, "5");
+    ASSERT_EQUAL(number("C6"_pos), 1015.0);
+    ASSERT_EQUAL(number("C2"_pos), 1000.0);
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(number("C6"_pos), 15.0);
+
+    // сводки по агрегатам совпадают с обходом ячеек
+    unsigned seed = 7;
+    auto next = [&seed](unsigned bound) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % bound);
+    };
+    for (int i = 0; i < 300; ++i) {
+        sheet.SetCell({next(1200), next(2)}, std::to_string(next(50) - 25));
+        if (i % 10 == 0) {
+            sheet.ClearCell({next(1200), next(2)});
+        }
+        int first = next(1200);
+        CellRange range{{first, next(2)}, {first + next(300), 1}};
+        RangeSummary fast = sheet.AggregateRange(range);
+        RangeSummary slow = sheet.SheetInterface::AggregateRange(range);
+        ASSERT_EQUAL(fast.sum, slow.sum);
+        ASSERT_EQUAL(fast.count, slow.count);
+        ASSERT_EQUAL(fast.min, slow.min);
+        ASSERT_EQUAL(fast.max, slow.max);
+        ASSERT_EQUAL(fast.error.has_value(), slow.error.has_value());
+    }
+
+    // итог под столбцом вычисляет только ячейки своего диапазона
+    Sheet totals;
+    for (int i = 0; i < 10; ++i) {
+        totals.SetCell({i, 0}, std::to_string(i));
+        totals.SetCell({i, 1}, "=" + std::to_string(i) + "*2");
+    }
+    totals.SetCell("A50"_pos, "=B1+1");
+    totals.SetCell("B50"_pos, "=A50*2");
+    totals.SetCell("A100"_pos, "=SUM(A1:A10)");
+    std::vector<CellInterface::Value> buffer;
+    totals.GetValues({"A100"_pos, "A100"_pos}, buffer);
+    ASSERT(buffer == std::vector<CellInterface::Value>({45.0}));
+    auto cached = [&totals](Position pos) {
+        return dynamic_cast<const Cell*>(totals.GetCell(pos))->HasCachedValue();
+    };
+    ASSERT(!cached("A50"_pos) && !cached("B1"_pos) && !cached("B50"_pos));
+    totals.SetCell("A5"_pos, "=B5");
+    ASSERT_EQUAL(std::get<double>(totals.GetCell("A100"_pos)->GetValue()), 45.0 - 4.0 + 8.0);
+    ASSERT(cached("B5"_pos) && !cached("B1"_pos));
+}
+
+void TestEditBatch() {
+    // правки пачки дают те же значения, что и по одной
+    Sheet batched;
+    Sheet plain;
+    batched.SetJournalLimit(0);
+    for (Sheet* sheet : {&batched, &plain}) {
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2");
+        sheet->SetCell("B1"_pos, "=A1+A2");
+        sheet->SetCell("B2"_pos, "=B1*2+A3");
+        sheet->SetCell("B3"_pos, "=SUM(A1:A5)");
+        sheet->SetCell("B4"_pos, "=B2+B3");
+    }
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(values(batched), values(plain));
+    auto edit = [](Sheet& sheet) {
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A1"_pos, "20");
+        sheet.ClearCell("A2"_pos);
+        sheet.SetCell("A3"_pos, "5");
+        sheet.SetCell("A4"_pos, "=A3*3");
+        sheet.ClearCell("A4"_pos);
+        sheet.SetCell("A5"_pos, "7");
+    };
+    batched.BeginBatch();
+    batched.BeginBatch();
+    edit(batched);
+    batched.EndBatch();
+    // вложенная пачка не сбрасывает кэш
+    ASSERT_EQUAL(std::get<double>(batched.GetCell("B4"_pos)->GetValue()), 9.0);
+    batched.SetCell("A2"_pos, "4");
+    batched.EndBatch();
+    edit(plain);
+    plain.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(values(batched), values(plain));
+    ASSERT_EQUAL(std::get<double>(batched.GetCell("B4"_pos)->GetValue()), 89.0);
+
+    // вставка строк внутри пачки сначала сбрасывает накопленное
+    batched.BeginBatch();
+    for (Sheet* sheet : {&batched, &plain}) {
+        sheet->SetCell("A1"_pos, "1");
+        sheet->InsertRows(0);
+        sheet->SetCell("A4"_pos, "0");
+    }
+    batched.EndBatch();
+    ASSERT_EQUAL(values(batched), values(plain));
+    ASSERT_EQUAL(std::get<double>(batched.GetCell("B5"_pos)->GetValue()), 22.0);
+}
+
+void TestAsyncSheet() {
+    Sheet sheet;
+    {
+        AsyncSheet engine(sheet);
+        engine.SetCellAsync("B1"_pos, "=SUM(A1:A400)");
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; ++t) {
+            producers.emplace_back([&engine, t] {
+                for (int i = 0; i < 100; ++i) {
+                    // каждая ячейка сначала получает промежуточное значение
+                    engine.SetCellAsync({t * 100 + i, 0}, "100");
+                    engine.SetCellAsync({t * 100 + i, 0}, std::to_string(i));
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        ASSERT_EQUAL(std::get<double>(engine.GetValueAsync("B1"_pos).get()), 4 * 4950.0);
+        ASSERT_EQUAL(engine.GetAppliedSequence(), 801u);
+
+        // чтение по номеру правки ждёт её применения
+        auto value = engine.GetValueAsync("C1"_pos, 803);
+        auto bad = engine.SetCellAsync("C1"_pos, "=1+");
+        ASSERT_EQUAL(bad.sequence, 802u);
+        auto cycle = engine.SetCellAsync("A1"_pos, "=B1");
+        ASSERT_EQUAL(std::get<double>(value.get()), 0.0);
+        try {
+            bad.applied.get();
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        try {
+            cycle.applied.get();
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        engine.ClearCellAsync("A2"_pos);
+        engine.SetCellAsync("A3"_pos, "=A2+1");
+        ASSERT_EQUAL(std::get<double>(engine.GetValueAsync("B1"_pos).get()), 4 * 4950.0 - 1.0 + 1.0 - 2.0);
+        ASSERT(engine.GetValueAsync("A3"_pos, engine.GetAppliedSequence()).get() == CellInterface::Value(1.0));
+
+        // отвергнутая последняя правка ячейки не отменяет предыдущую, а
+        // проверки циклов идут в порядке правок
+        auto five = engine.SetCellAsync("D1"_pos, "5");
+        auto self = engine.SetCellAsync("D1"_pos, "=D1");
+        auto forward = engine.SetCellAsync("E1"_pos, "=F1");
+        auto back = engine.SetCellAsync("F1"_pos, "=E1");
+        auto plain = engine.SetCellAsync("E1"_pos, "7");
+        five.applied.get();
+        forward.applied.get();
+        plain.applied.get();
+        for (auto* rejected : {&self, &back}) {
+            try {
+                rejected->applied.get();
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        ASSERT(engine.GetValueAsync("D1"_pos).get() == CellInterface::Value(5.0));
+    }
+    // после остановки движка лист снова доступен напрямую
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A2+1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "7");
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+}
+
+void TestEvaluationLimits() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < 2000; ++i) {
+        sheet.SetCell({i, 0}, "=A" + std::to_string(i) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=A2000*2");
+    auto cell = [&sheet](Position pos) {
+        return dynamic_cast<const Cell*>(sheet.GetCell(pos));
+    };
+
+    CancellationToken cancel;
+    cancel.Cancel();
+    EvaluationLimits cancelled{std::nullopt, &cancel};
+    ASSERT(sheet.GetValue("B1"_pos, cancelled).status == EvaluationStatus::Partial);
+    ASSERT(sheet.Recalculate(cancelled) == EvaluationStatus::Partial);
+    // прерванные ячейки не кэшируются
+    ASSERT(!cell("B1"_pos)->HasCachedValue());
+    ASSERT(!cell("A2000"_pos)->HasCachedValue());
+
+    auto expired = EvaluationLimits::Timeout(std::chrono::steady_clock::duration::zero());
+    ASSERT(sheet.GetValue("A1500"_pos, expired).status == EvaluationStatus::Partial);
+    // значения простых ячеек не требуют вычислений
+    ASSERT(sheet.GetValue("A1"_pos, expired).value == CellInterface::Value(1.0));
+    ASSERT(sheet.GetValue("C1"_pos, expired).value == CellInterface::Value(0.0));
+
+    auto result = sheet.GetValue("B1"_pos, EvaluationLimits::Timeout(std::chrono::minutes(1)));
+    ASSERT(result.status == EvaluationStatus::Complete);
+    ASSERT_EQUAL(std::get<double>(result.value), 4000.0);
+    ASSERT(sheet.Recalculate(cancelled) == EvaluationStatus::Complete);
+
+    // без ограничений вычисление не прерывается и после прерванного
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT(sheet.GetValue("B1"_pos, cancelled).status == EvaluationStatus::Partial);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4002.0);
+}
+
+void TestRangeDependents() {
+    // нарастающие итоги: правка ячейки находит только содержащие её диапазоны
+    Sheet sheet;
+    const int rows = 2000;
+    for (int i = 0; i < rows; ++i) {
+        sheet.SetCell({i, 0}, "1");
+        sheet.SetCell({i, 1}, "=SUM(A1:A" + std::to_string(i + 1) + ")");
+    }
+    auto number = [&sheet](Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    ASSERT_EQUAL(number({rows - 1, 1}), static_cast<double>(rows));
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(number({0, 1}), 3.0);
+    ASSERT_EQUAL(number({rows - 1, 1}), static_cast<double>(rows + 2));
+    sheet.SetCell({rows - 1, 0}, "5");
+    ASSERT_EQUAL(number({rows - 2, 1}), static_cast<double>(rows + 1));
+    ASSERT_EQUAL(number({rows - 1, 1}), static_cast<double>(rows + 6));
+    sheet.DeleteRows(0, 1);
+    ASSERT_EQUAL(number({rows - 2, 1}), static_cast<double>(rows + 3));
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(number({rows - 2, 1}), static_cast<double>(rows + 4));
+    for (int i = 0; i < rows - 1; ++i) {
+        sheet.ClearCell({i, 1});
+    }
+    sheet.SetCell("A1"_pos, "=B1");
+    ASSERT_EQUAL(number("A1"_pos), 0.0);
+
+    // поиск совпадает с перебором диапазонов
+    unsigned seed = 11;
+    auto next = [&seed](unsigned bound) {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % bound);
+    };
+    RangeIndex index;
+    std::set<CellRange> ranges;
+    for (int i = 0; i < 2000; ++i) {
+        Position first{next(100), next(20)};
+        CellRange range{first, {first.row + next(40), first.col + next(5)}};
+        if (i % 3 == 0 && !ranges.empty()) {
+            range = *ranges.begin();
+            index.Remove(range);
+            ranges.erase(range);
+        } else {
+            index.Add(range);
+            ranges.insert(range);
+        }
+        Position pos{next(140), next(25)};
+        std::vector<CellRange> found;
+        index.ForEachContaining(pos, [&found](const CellRange& range) {
+            found.push_back(range);
+        });
+        std::vector<CellRange> expected;
+        std::copy_if(ranges.begin(), ranges.end(), std::back_inserter(expected), [pos](const CellRange& range) {
+            return range.Contains(pos);
+        });
+        std::sort(found.begin(), found.end());
+        ASSERT(found == expected);
+        ASSERT_EQUAL(index.AnyContains(pos), !expected.empty());
+    }
+    for (const auto& range : ranges) {
+        index.Remove(range);
+    }
+    ASSERT(index.Empty());
+}
+
+void TestDeepChain() {
+    // цепочка идёт вниз по столбцу и продолжается с верха следующего
+    const int length = 1 << 20;
+    auto chain_pos = [](int k) {
+        return Position{k % Position::MAX_ROWS, k / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(length);
+    cells.emplace_back(chain_pos(0), "1");
+    for (int k = 1; k < length; ++k) {
+        cells.emplace_back(chain_pos(k), "=" + chain_pos(k - 1).ToString() + "+1");
+    }
+    sheet.LoadCells(cells);
+    cells.clear();
+    Position last = chain_pos(length - 1);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), double(length));
+    // сброс проходит всю цепочку, пересчёт начинается с середины
+    sheet.SetCell(chain_pos(0), "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(chain_pos(length / 2))->GetValue()), double(length / 2 + 2));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), double(length + 1));
+
+    // цепочка через диапазоны: каждую формулу вычисляет агрегат по столбцу
+    Sheet ranged;
+    const int rows = 16000;
+    cells.emplace_back(Position{0, 0}, "1");
+    for (int row = 1; row < rows; ++row) {
+        std::string prev = Position{row - 1, 0}.ToString();
+        cells.emplace_back(Position{row, 0}, "=SUM(" + prev + ":" + prev + ")+1");
+    }
+    ranged.LoadCells(cells);
+    ASSERT_EQUAL(std::get<double>(ranged.GetCell({rows - 1, 0})->GetValue()), double(rows));
+}
+
+void TestParseFormulas() {
+    std::vector<std::string> expressions;
+    for (int i = 0; i < 5000; ++i) {
+        expressions.push_back("A" + std::to_string(i + 1) + "*" + std::to_string(i % 7));
+    }
+    auto formulas = ParseFormulas(expressions, 4);
+    ASSERT_EQUAL(formulas.size(), expressions.size());
+    for (size_t i = 0; i < formulas.size(); i += 997) {
+        ASSERT_EQUAL(formulas[i]->GetExpression(), expressions[i]);
+    }
+    expressions[4000] = "1+";
+    expressions[1000] = "(";
+    try {
+        ParseFormulas(expressions, 4);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    // разбор в потоке продолжается после ошибки
+    ASSERT_EQUAL(ParseFormula("1+2")->GetExpression(), "1+2");
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int i = 0; i < 3000; ++i) {
+        cells.emplace_back(Position{i, 0}, std::to_string(i));
+        cells.emplace_back(Position{i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+    cells.emplace_back("C1"_pos, "=");
+    sheet.LoadCells(cells);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3000"_pos)->GetValue()), 5998.0);
+    ASSERT_EQUAL(sheet.GetCell("B10"_pos)->GetText(), "=A10*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=");
+    sheet.SetCell("A10"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B10"_pos)->GetValue()), 10.0);
+    // синтаксическая ошибка не оставляет частично загруженных ячеек
+    try {
+        sheet.LoadCells({{"D1"_pos, "=1"}, {"D2"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+}
+
+void TestChangeNotifications() {
+    Sheet sheet;
+    std::vector<std::vector<CellRange>> events;
+    auto range = [](std::string_view text) {
+        auto colon = text.find(':');
+        return CellRange{Position::FromString(text.substr(0, colon)), Position::FromString(text.substr(colon + 1))};
+    };
+    size_t id = sheet.Subscribe(range("A1:C10"), [&events](const std::vector<CellRange>& ranges) {
+        events.push_back(ranges);
+    });
+    for (int i = 0; i < 5; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+    sheet.SetCell("D1"_pos, "=SUM(B1:B5)");
+    events.clear();
+
+    // зависимые формулы попадают в событие, соседние ячейки объединяются
+    sheet.SetCell("A3"_pos, "7");
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT(events[0] == std::vector<CellRange>({range("A3:B3")}));
+
+    // правки транзакции приходят одним событием, D1 вне области подписки
+    events.clear();
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("A2"_pos, "20");
+    sheet.ClearCell("A4"_pos);
+    ASSERT(events.empty());
+    sheet.CommitTransaction();
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT(events[0] == std::vector<CellRange>({range("A1:B2"), range("A4:B4")}));
+
+    events.clear();
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT(events[0] == std::vector<CellRange>({range("A1:B2"), range("A4:B4")}));
+
+    // изменения вне области не рассылаются
+    events.clear();
+    sheet.SetCell("E5"_pos, "1");
+    ASSERT(events.empty());
+
+    // вставка строки сдвигает значения ниже неё
+    sheet.InsertRows(7);
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT(events[0] == std::vector<CellRange>({range("A8:C10")}));
+
+    // изменения на другом листе книги доходят до подписчиков зависимого
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    second.SetCell("A1"_pos, "=First!A1+1");
+    ASSERT(!book.HasSubscriptions());
+    std::vector<CellRange> second_changes;
+    size_t second_id = second.Subscribe(range("A1:A1"), [&second_changes](const std::vector<CellRange>& ranges) {
+        second_changes = ranges;
+    });
+    ASSERT(book.HasSubscriptions());
+    first.SetCell("A1"_pos, "5");
+    ASSERT(second_changes == std::vector<CellRange>({range("A1:A1")}));
+    // повторная отписка не сбивает счётчик подписок книги
+    size_t first_id = first.Subscribe(range("A1:A1"), [](const std::vector<CellRange>&) {});
+    second.Unsubscribe(second_id);
+    second.Unsubscribe(second_id);
+    ASSERT(book.HasSubscriptions());
+    first.Unsubscribe(first_id);
+    ASSERT(!book.HasSubscriptions());
+    second_changes.clear();
+    first.SetCell("A1"_pos, "6");
+    ASSERT(second_changes.empty());
+
+    sheet.Unsubscribe(id);
+    events.clear();
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT(events.empty());
+}
+
+void TestViewportEvaluation() {
+    Sheet sheet;
+    for (int i = 0; i < 100; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+    sheet.SetCell("C2"_pos, "=B50+1");
+    sheet.SetCell("D1"_pos, "text");
+    auto cached = [&sheet](Position pos) {
+        return dynamic_cast<const Cell*>(sheet.GetCell(pos))->HasCachedValue();
+    };
+
+    std::ostringstream values;
+    sheet.PrintValues(values, {"B1"_pos, "D2"_pos});
+    ASSERT_EQUAL(values.str(), "0\t\ttext\n2\t99\t\n");
+    // вычислены только ячейки области и их входы
+    ASSERT(cached("B1"_pos) && cached("B2"_pos) && cached("C2"_pos) && cached("B50"_pos));
+    ASSERT(!cached("B3"_pos) && !cached("B100"_pos));
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts, {"A2"_pos, "C2"_pos});
+    ASSERT_EQUAL(texts.str(), "1\t=A2*2\t=B50+1\n");
+
+    std::vector<CellInterface::Value> buffer;
+    sheet.GetValues({"B99"_pos, "C100"_pos}, buffer);
+    ASSERT(buffer == std::vector<CellInterface::Value>({196.0, 0.0, 198.0, 0.0}));
+    ASSERT(!cached("B98"_pos));
+
+    try {
+        sheet.GetValues({"B2"_pos, "A1"_pos}, buffer);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestParallelExport() {
+    Sheet sheet;
+    for (int i = 0; i < 3000; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i * 0.37));
+        sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "/" + std::to_string(i % 5));
+        sheet.SetCell({i, 2}, i % 3 == 0 ? "'=text" : "=B" + std::to_string(i + 1) + "*3.14159");
+    }
+    sheet.SetCell("X2999"_pos, "end");
+    ASSERT(static_cast<size_t>(sheet.GetPrintableSize().rows) * sheet.GetPrintableSize().cols
+           >= Sheet::PARALLEL_EXPORT_CELLS);
+    auto print = [&sheet](bool values, size_t threads) {
+        std::ostringstream out;
+        out.precision(10);
+        out.width(3);
+        if (values) {
+            sheet.PrintValues(out, threads);
+        } else {
+            sheet.PrintTexts(out, threads);
+        }
+        return out.str();
+    };
+    std::string serial_values = print(true, 1);
+    ASSERT_EQUAL(print(true, 4), serial_values);
+    ASSERT_EQUAL(print(false, 4), print(false, 1));
+    sheet.SetCell("A1"_pos, "100");
+    ASSERT(print(true, 3) != serial_values);
+    ASSERT_EQUAL(print(true, 3), print(true, 1));
+}
+
+void TestCommonSubexpressions() {
+    Sheet shared;
+    Sheet plain;
+    auto set_cell = [&](Position pos, const std::string& text) {
+        shared.SetCell(pos, text);
+        plain.SetCell(pos, text);
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    set_cell("A1"_pos, "2");
+    set_cell("B1"_pos, "3");
+    set_cell("C1"_pos, "=(A1+B1)*2+1");
+    set_cell("C2"_pos, "=1-(A1+B1)*2");
+    set_cell("C3"_pos, "=A1+B1");
+    set_cell("C4"_pos, "=IF(A1>2,1/(A1-2),0)");
+    set_cell("C5"_pos, "=IF(A1>2,1/(A1-2),5)");
+    set_cell("C6"_pos, "=SUM(A1:B1)+SUM(A1:B1)");
+    set_cell("C7"_pos, "=A1*0.1+A1*0.1");
+    // (A1+B1)*2, A1+B1, A1>2, 1/(A1-2), A1*0.1; диапазоны не разделяются, A1-2
+    // встречается только внутри общего 1/(A1-2)
+    ASSERT_EQUAL(shared.ShareCommonSubexpressions(), 5u);
+    ASSERT_EQUAL(values(shared), values(plain));
+    ASSERT_EQUAL(shared.GetCell("C2"_pos)->GetText(), "=1-(A1+B1)*2");
+
+    set_cell("A1"_pos, "4");
+    ASSERT_EQUAL(values(shared), values(plain));
+    ASSERT(std::get<double>(shared.GetCell("C4"_pos)->GetValue()) == 0.5);
+    set_cell("C3"_pos, "=B1");
+    set_cell("B1"_pos, "text");
+    ASSERT_EQUAL(values(shared), values(plain));
+    // Вытесненные в журнал формулы по-прежнему читают скрытые ячейки
+    ASSERT(shared.Undo() && plain.Undo());
+    ASSERT(shared.Undo() && plain.Undo());
+    ASSERT_EQUAL(values(shared), values(plain));
+    ASSERT(shared.MemoryUsage().Total() > plain.MemoryUsage().Total());
+
+    // Повторная разметка перестраивается с нуля, сдвиг её снимает
+    ASSERT_EQUAL(shared.ShareCommonSubexpressions(), 5u);
+    shared.InsertRows(0);
+    plain.InsertRows(0);
+    set_cell("A2"_pos, "1");
+    ASSERT_EQUAL(values(shared), values(plain));
+    ASSERT_EQUAL(shared.ShareCommonSubexpressions(), 5u);
+    set_cell("B2"_pos, "5");
+    ASSERT_EQUAL(values(shared), values(plain));
+    shared.UnshareCommonSubexpressions();
+    set_cell("A2"_pos, "7");
+    ASSERT_EQUAL(values(shared), values(plain));
+}
+
+std::string SheetTexts(const Sheet& sheet) {
+    std::ostringstream out;
+    sheet.PrintTexts(out);
+    return out.str();
+}
+
+void TestOperationTrace() {
+    LatencyHistogram histogram;
+    for (int ns : {1, 5, 100, 1000, 1000, 1000, 1000, 1000, 1000, 50000}) {
+        histogram.Add(std::chrono::nanoseconds(ns));
+    }
+    ASSERT_EQUAL(histogram.Count(), 10u);
+    ASSERT_EQUAL(histogram.Max().count(), 50000);
+    ASSERT(histogram.Percentile(0.5).count() >= 1000 && histogram.Percentile(0.5).count() <= 1250);
+    ASSERT_EQUAL(histogram.Percentile(1.0).count(), 50000);
+    for (size_t bucket = 0; bucket + 1 < LatencyHistogram::BUCKETS; ++bucket) {
+        ASSERT(LatencyHistogram::BucketFloor(bucket) < LatencyHistogram::BucketFloor(bucket + 1));
+    }
+
+    Sheet original;
+    std::ostringstream trace;
+    {
+        RecordingSheet recorder(original, trace);
+        SheetInterface& sheet = recorder;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "=A1*3");
+        try {
+            sheet.SetCell("A1"_pos, "=A2");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(sheet.GetCell("A2"_pos)->GetValue() == CellInterface::Value(6.0));
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        sheet.SetCell("B1"_pos, "text");
+        sheet.ClearCell("B1"_pos);
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        sheet.PrintTexts(out);
+        ASSERT_EQUAL(out.str(), "2\n6\n2\n=A1*3\n");
+    }
+    const std::string data = trace.str();
+    ASSERT(data.size() < 100u);
+
+    Sheet replayed;
+    std::istringstream input(data);
+    ReplayReport report = ReplayTrace(input, replayed);
+    ASSERT_EQUAL(SheetTexts(replayed), SheetTexts(original));
+    ASSERT_EQUAL(report.failures, 1u);
+    ASSERT_EQUAL(report.replayed[static_cast<size_t>(TraceOp::SetCell)].Count(), 4u);
+    ASSERT_EQUAL(report.recorded[static_cast<size_t>(TraceOp::SetCell)].Count(), 4u);
+    ASSERT_EQUAL(report.replayed[static_cast<size_t>(TraceOp::GetValue)].Count(), 1u);
+    ASSERT_EQUAL(report.replayed[static_cast<size_t>(TraceOp::PrintTexts)].Count(), 1u);
+    ASSERT(report.wall_time < std::chrono::milliseconds(20));
+    std::ostringstream table;
+    report.Print(table);
+    ASSERT(table.str().find("ClearCell") != std::string::npos);
+
+    // Исходный темп: пауза между операциями сохраняется
+    Sheet paced;
+    input = std::istringstream(data);
+    ASSERT(ReplayTrace(input, paced, ReplayPacing::Original).wall_time >= std::chrono::milliseconds(20));
+    // Оборванная последняя запись (PrintTexts) отбрасывается
+    Sheet truncated;
+    input = std::istringstream(data.substr(0, data.size() - 1));
+    report = ReplayTrace(input, truncated);
+    ASSERT_EQUAL(report.replayed[static_cast<size_t>(TraceOp::PrintTexts)].Count(), 0u);
+    ASSERT_EQUAL(report.replayed[static_cast<size_t>(TraceOp::PrintValues)].Count(), 1u);
+    input = std::istringstream("not a trace");
+    try {
+        ReplayTrace(input, truncated);
+        ASSERT(false);
+    } catch (const std::runtime_error&) {
+    }
+}
+
+void TestEditLogRecovery() {
+    namespace fs = std::filesystem;
+    const std::string snapshot_path = (fs::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    const std::string log_path = (fs::temp_directory_path() / "spreadsheet_test.wal").string();
+    fs::remove(snapshot_path);
+    fs::remove(log_path);
+
+    std::string expected;
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path, 4);
+        ASSERT_EQUAL(log.Recover(sheet), 0u);
+        sheet.SetEditLog(&log);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "text");
+        sheet.ClearCell("B1"_pos);
+        sheet.InsertRows(0);
+        sheet.SetCell("A1"_pos, "=A3*2");
+        sheet.SetCell("C1"_pos, "x");
+        ASSERT(sheet.Undo());
+        log.Checkpoint(sheet);
+        sheet.SetCell("D4"_pos, "=A1+A2");
+        sheet.DeleteCols(1);
+        expected = SheetTexts(sheet);
+    }
+    // оборванная при сбое запись в конце журнала
+    std::ofstream(log_path, std::ios::binary | std::ios::app) << "\x05\x01\x02";
+
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path);
+        ASSERT_EQUAL(log.Recover(sheet), 2u);
+        ASSERT_EQUAL(SheetTexts(sheet), expected);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C4"_pos)->GetValue()), 5.0);
+        sheet.SetEditLog(&log);
+        sheet.SetCell("A2"_pos, "5");
+        expected = SheetTexts(sheet);
+    }
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path);
+        ASSERT_EQUAL(log.Recover(sheet), 3u);
+        ASSERT_EQUAL(SheetTexts(sheet), expected);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C4"_pos)->GetValue()), 17.0);
+    }
+
+    // снимок после удаления строк со сломанными ссылками восстанавливается
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path);
+        log.Recover(sheet);
+        sheet.SetEditLog(&log);
+        sheet.SetCell("E1"_pos, "1");
+        sheet.SetCell("E2"_pos, "2");
+        sheet.SetCell("F1"_pos, "=E1+E2");
+        sheet.DeleteRows(1, 1);
+        log.Checkpoint(sheet);
+        expected = SheetTexts(sheet);
+    }
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path);
+        ASSERT_EQUAL(log.Recover(sheet), 0u);
+        ASSERT_EQUAL(SheetTexts(sheet), expected);
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=E1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    }
+
+    // неполная пачка сбрасывается на диск по времени, без Flush
+    {
+        Sheet sheet;
+        EditLog log(snapshot_path, log_path, 64, std::chrono::milliseconds(10));
+        log.Recover(sheet);
+        sheet.SetEditLog(&log);
+        sheet.SetCell("G1"_pos, "late");
+        const auto size = fs::file_size(log_path);
+        for (int i = 0; i < 500 && fs::file_size(log_path) == size; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT(fs::file_size(log_path) > size);
+        Sheet copy;
+        EditLog reader(snapshot_path, log_path);
+        ASSERT_EQUAL(reader.Recover(copy), 1u);
+        ASSERT_EQUAL(copy.GetCell("G1"_pos)->GetText(), "late");
+    }
+    fs::remove(snapshot_path);
+    fs::remove(log_path);
+}
+
 void PrintSheet(const std::unique_ptr<SheetInterface>& sheet) {
     std::cout << sheet->GetPrintableSize() << std::endl;
     sheet->PrintTexts(std::cout);
@@ -418,9 +1769,30 @@ void TestClearPrint() {
         PrintSheet(sheet);
     }
 }
+
+// spreadsheet --replay trace [--paced]: воспроизводит трассу вызовов (см.
+// RecordingSheet) на пустом листе и печатает гистограммы задержек
+int ReplayMain(const std::string& path, bool paced) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return 1;
+    }
+    Sheet sheet;
+    try {
+        ReplayTrace(input, sheet, paced ? ReplayPacing::Original : ReplayPacing::FullSpeed).Print(std::cout);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc >= 3 && std::string(argv[1]) == "--replay") {
+        return ReplayMain(argv[2], argc >= 4 && std::string(argv[3]) == "--paced");
+    }
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -433,6 +1805,7 @@ int main() {
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaConstantFolding);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
@@ -442,6 +1815,32 @@ int main() {
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
     RUN_TEST(tr, TestSetGetCellCellRef);
+    RUN_TEST(tr, TestChromeTrace);
+    RUN_TEST(tr, TestProfileReport);
+    RUN_TEST(tr, TestColumnRunEvaluation);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestCanonicalFormulaText);
+    RUN_TEST(tr, TestWorkbookCrossSheetReferences);
+    RUN_TEST(tr, TestWorkbookParallelRecalculation);
+    RUN_TEST(tr, TestUndoRedoJournal);
+    RUN_TEST(tr, TestEditLogRecovery);
+    RUN_TEST(tr, TestMemoryBudget);
+    RUN_TEST(tr, TestEmptyReferencedPositions);
+    RUN_TEST(tr, TestReferencedCellsView);
+    RUN_TEST(tr, TestFormulaFunctions);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestRangeDependents);
+    RUN_TEST(tr, TestEditBatch);
+    RUN_TEST(tr, TestAsyncSheet);
+    RUN_TEST(tr, TestEvaluationLimits);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestParseFormulas);
+    RUN_TEST(tr, TestChangeNotifications);
+    RUN_TEST(tr, TestViewportEvaluation);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestCommonSubexpressions);
+    RUN_TEST(tr, TestOperationTrace);
     //TestClearPrint();
     //std::cout << "(5, 5)\n0\n\t1\n\t\t2\n\n\t\t\t\t4\n\n0\n\t1\n\t\t2\n\n\t\t\t\t4\n\n(3, 3)\n0\n\t1\n\t\t2\n\n0\n\t1\n\t\t2\n\n(3, 3)\n0\n\t1\n\t\t2\n\n0\n\t1\n\t\t2\n\n(2, 2)\n0\n\t1\n\n0\n\t1\n\n(1, 1)\n0\n\n0\n\n(0, 0)\n\n" << std::endl;
 }   
@@ -0,0 +1,380 @@
+#include "operation_trace.h"
+
+#include "binary_format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+
+namespace {
+
+std::uint64_t ToNanoseconds(std::chrono::steady_clock::duration duration) {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+bool HasPosition(TraceOp op) {
+    return op == TraceOp::SetCell || op == TraceOp::ClearCell || op == TraceOp::GetValue;
+}
+
+// Поток, отбрасывающий вывод: печать при воспроизведении форматирует ячейки
+// как обычно, но никуда не пишет
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* /* s */, std::streamsize count) override {
+        return count;
+    }
+};
+
+}  // namespace
+
+const char* ToString(TraceOp op) {
+    switch (op) {
+        case TraceOp::SetCell:
+            return "SetCell";
+        case TraceOp::ClearCell:
+            return "ClearCell";
+        case TraceOp::GetValue:
+            return "GetValue";
+        case TraceOp::PrintValues:
+            return "PrintValues";
+        case TraceOp::PrintTexts:
+            return "PrintTexts";
+    }
+    return "Unknown";
+}
+
+// Запись
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, std::ostream& trace)
+    : sheet_(sheet)
+    , trace_(trace)
+    , last_start_(Clock::now())
+    , pending_(TRACE_MAGIC) {
+}
+
+RecordingSheet::~RecordingSheet() {
+    try {
+        Flush();
+    } catch (const std::exception&) {
+    }
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    std::string argument = text;
+    Timed(TraceOp::SetCell, pos, text, [&] {
+        sheet_.SetCell(pos, std::move(argument));
+    });
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    return GetRecordedCell(pos);
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    return GetRecordedCell(pos);
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    Timed(TraceOp::ClearCell, pos, {}, [&] {
+        sheet_.ClearCell(pos);
+    });
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    Timed(TraceOp::PrintValues, Position::NONE, {}, [&] {
+        sheet_.PrintValues(output);
+    });
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    Timed(TraceOp::PrintTexts, Position::NONE, {}, [&] {
+        sheet_.PrintTexts(output);
+    });
+}
+
+const SheetInterface* RecordingSheet::FindSheet(std::string_view name) const {
+    return sheet_.FindSheet(name);
+}
+
+void RecordingSheet::ForEachCellInRange(const CellRange& range,
+                                        const std::function<void(Position, const CellInterface&)>& action) const {
+    sheet_.ForEachCellInRange(range, action);
+}
+
+std::optional<int> RecordingSheet::FindInColumn(int col, int first_row, int last_row, double key, bool exact) const {
+    return sheet_.FindInColumn(col, first_row, last_row, key, exact);
+}
+
+RangeSummary RecordingSheet::AggregateRange(const CellRange& range) const {
+    return sheet_.AggregateRange(range);
+}
+
+void RecordingSheet::Flush() {
+    WritePending();
+    trace_.flush();
+    if (!trace_) {
+        throw std::runtime_error("Failed to write the operation trace");
+    }
+}
+
+// Пустая позиция возвращается как nullptr, как у самого листа
+CellInterface* RecordingSheet::GetRecordedCell(Position pos) const {
+    if (sheet_.GetCell(pos) == nullptr) {
+        return nullptr;
+    }
+    auto it = cells_.try_emplace(pos, *this, pos).first;
+    return &it->second;
+}
+
+template <typename Call>
+void RecordingSheet::Timed(TraceOp op, Position pos, std::string_view text, Call call) const {
+    auto start = Clock::now();
+    try {
+        call();
+    } catch (...) {
+        Append(op, start, pos, text);
+        throw;
+    }
+    Append(op, start, pos, text);
+}
+
+void RecordingSheet::Append(TraceOp op, Clock::time_point start, Position pos, std::string_view text) const {
+    auto end = Clock::now();
+    pending_.push_back(static_cast<char>(op));
+    // Вложенные вызовы (например, из обработчика подписки) начинаются раньше
+    // уже записанного внешнего
+    PutVarint(pending_, start > last_start_ ? ToNanoseconds(start - last_start_) : 0);
+    last_start_ = std::max(last_start_, start);
+    PutVarint(pending_, ToNanoseconds(end - start));
+    if (HasPosition(op)) {
+        PutVarint(pending_, static_cast<std::uint32_t>(pos.row));
+        PutVarint(pending_, static_cast<std::uint32_t>(pos.col));
+    }
+    if (op == TraceOp::SetCell) {
+        PutVarint(pending_, text.size());
+        pending_.append(text);
+    }
+    if (pending_.size() >= FLUSH_BYTES) {
+        WritePending();
+    }
+}
+
+void RecordingSheet::WritePending() const {
+    trace_.write(pending_.data(), static_cast<std::streamsize>(pending_.size()));
+    pending_.clear();
+    if (!trace_) {
+        throw std::runtime_error("Failed to write the operation trace");
+    }
+}
+
+RecordingSheet::RecordedCell::RecordedCell(const RecordingSheet& owner, Position pos)
+    : owner_(owner)
+    , pos_(pos) {
+}
+
+CellInterface::Value RecordingSheet::RecordedCell::GetValue() const {
+    Value value;
+    owner_.Timed(TraceOp::GetValue, pos_, {}, [&] {
+        const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+        value = cell != nullptr ? cell->GetValue() : Value(0.0);
+    });
+    return value;
+}
+
+std::string RecordingSheet::RecordedCell::GetText() const {
+    const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+    return cell != nullptr ? cell->GetText() : std::string();
+}
+
+std::vector<Position> RecordingSheet::RecordedCell::GetReferencedCells() const {
+    const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+    return cell != nullptr ? cell->GetReferencedCells() : std::vector<Position>();
+}
+
+// Гистограмма
+
+// Значения меньше 4 нс получают по корзине; дальше корзина 4(e-1)+s
+// покрывает [(4+s)*2^(e-2), (5+s)*2^(e-2)), где 2^e - старший бит значения
+size_t LatencyHistogram::GetBucket(std::uint64_t ns) {
+    if (ns < 4) {
+        return static_cast<size_t>(ns);
+    }
+    int exponent = 2;
+    while (exponent < 63 && (ns >> (exponent + 1)) != 0) {
+        ++exponent;
+    }
+    size_t bucket = 4 * static_cast<size_t>(exponent - 1) + ((ns >> (exponent - 2)) & 3);
+    return std::min(bucket, BUCKETS - 1);
+}
+
+std::uint64_t LatencyHistogram::BucketFloor(size_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int exponent = static_cast<int>(bucket / 4) + 1;
+    return static_cast<std::uint64_t>(4 + bucket % 4) << (exponent - 2);
+}
+
+void LatencyHistogram::Add(std::chrono::nanoseconds latency) {
+    latency = std::max(latency, std::chrono::nanoseconds(0));
+    ++buckets_[GetBucket(static_cast<std::uint64_t>(latency.count()))];
+    ++count_;
+    total_ += latency;
+    max_ = std::max(max_, latency);
+}
+
+size_t LatencyHistogram::Count() const {
+    return count_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::Total() const {
+    return total_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::Max() const {
+    return max_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::Percentile(double fraction) const {
+    if (count_ == 0) {
+        return std::chrono::nanoseconds(0);
+    }
+    auto target = static_cast<size_t>(std::ceil(std::clamp(fraction, 0.0, 1.0) * count_));
+    target = std::clamp<size_t>(target, 1, count_);
+    size_t seen = 0;
+    for (size_t bucket = 0; bucket + 1 < BUCKETS; ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= target) {
+            auto ceiling = std::chrono::nanoseconds(static_cast<std::int64_t>(BucketFloor(bucket + 1)));
+            return std::min(ceiling, max_);
+        }
+    }
+    return max_;
+}
+
+const std::array<size_t, LatencyHistogram::BUCKETS>& LatencyHistogram::Buckets() const {
+    return buckets_;
+}
+
+// Воспроизведение
+
+void ReplayReport::Print(std::ostream& output) const {
+    auto micros = [](std::chrono::nanoseconds ns) {
+        return static_cast<double>(ns.count()) / 1000.0;
+    };
+    std::ios_base::fmtflags flags = output.flags();
+    std::streamsize precision = output.precision();
+    output << std::fixed << std::setprecision(1);
+    output << std::left << std::setw(12) << "operation" << std::right << std::setw(9) << "count";
+    for (const char* source : {"", "rec "}) {
+        for (const char* column : {"p50", "p90", "p99", "max"}) {
+            output << std::setw(12) << (std::string(source) + column);
+        }
+    }
+    output << "\n";
+    for (size_t op = 0; op < TRACE_OP_COUNT; ++op) {
+        if (replayed[op].Count() == 0) {
+            continue;
+        }
+        output << std::left << std::setw(12) << ToString(static_cast<TraceOp>(op)) << std::right
+               << std::setw(9) << replayed[op].Count();
+        for (const LatencyHistogram* histogram : {&replayed[op], &recorded[op]}) {
+            for (double fraction : {0.5, 0.9, 0.99}) {
+                output << std::setw(12) << micros(histogram->Percentile(fraction));
+            }
+            output << std::setw(12) << micros(histogram->Max());
+        }
+        output << "\n";
+    }
+    output << "latencies in us, rec - recorded in the trace; failures: " << failures << ", wall time: " << micros(wall_time) / 1000.0
+           << " ms\n";
+    output.flags(flags);
+    output.precision(precision);
+}
+
+ReplayReport ReplayTrace(std::istream& trace, SheetInterface& sheet, ReplayPacing pacing) {
+    const std::string data(std::istreambuf_iterator<char>(trace), {});
+    std::string_view in = data;
+    if (in.substr(0, TRACE_MAGIC.size()) != TRACE_MAGIC) {
+        throw std::runtime_error("Not an operation trace");
+    }
+    in.remove_prefix(TRACE_MAGIC.size());
+
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+    ReplayReport report;
+    const auto replay_start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds offset{0};
+    while (!in.empty()) {
+        auto op = static_cast<TraceOp>(in.front());
+        if (static_cast<size_t>(op) >= TRACE_OP_COUNT) {
+            throw std::runtime_error("Unknown operation in the trace");
+        }
+        // Запись разбирается целиком до выполнения: оборванная не выполняется
+        std::string_view rest = in.substr(1);
+        std::uint64_t delay, duration, row = 0, col = 0, size = 0;
+        if (!GetVarint(rest, delay) || !GetVarint(rest, duration)) {
+            break;
+        }
+        if (HasPosition(op) && (!GetVarint(rest, row) || !GetVarint(rest, col))) {
+            break;
+        }
+        std::string text;
+        if (op == TraceOp::SetCell) {
+            if (!GetVarint(rest, size) || rest.size() < size) {
+                break;
+            }
+            text = rest.substr(0, size);
+            rest.remove_prefix(size);
+        }
+        in = rest;
+        Position pos{static_cast<int>(static_cast<std::uint32_t>(row)),
+                     static_cast<int>(static_cast<std::uint32_t>(col))};
+        offset += std::chrono::nanoseconds(delay);
+        report.recorded[static_cast<size_t>(op)].Add(std::chrono::nanoseconds(duration));
+        if (pacing == ReplayPacing::Original) {
+            std::this_thread::sleep_until(replay_start + offset);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            switch (op) {
+                case TraceOp::SetCell:
+                    sheet.SetCell(pos, std::move(text));
+                    break;
+                case TraceOp::ClearCell:
+                    sheet.ClearCell(pos);
+                    break;
+                case TraceOp::GetValue:
+                    if (const CellInterface* cell = sheet.GetCell(pos)) {
+                        cell->GetValue();
+                    }
+                    break;
+                case TraceOp::PrintValues:
+                    sheet.PrintValues(null_output);
+                    break;
+                case TraceOp::PrintTexts:
+                    sheet.PrintTexts(null_output);
+                    break;
+            }
+        } catch (const std::exception&) {
+            ++report.failures;
+        }
+        report.replayed[static_cast<size_t>(op)].Add(std::chrono::steady_clock::now() - start);
+    }
+    report.wall_time = std::chrono::steady_clock::now() - replay_start;
+    return report;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+
+// Трассы вызовов листа: запись последовательности операций клиента и её
+// воспроизведение на движке, чтобы замедление у клиента стало локальным
+// бенчмарком.
+//
+// Трасса - двоичный поток: сигнатура TRACE_MAGIC, затем записи вида
+//     операция (1 байт), начало (varint, нс от начала предыдущей записи),
+//     длительность (varint, нс), [строка, столбец (varint)],
+//     [длина текста (varint), текст]
+// Позиция есть у всех операций, кроме печати, текст - только у SetCell.
+
+enum class TraceOp : std::uint8_t {
+    SetCell,
+    ClearCell,
+    GetValue,
+    PrintValues,
+    PrintTexts,
+};
+
+inline constexpr size_t TRACE_OP_COUNT = 5;
+inline constexpr std::string_view TRACE_MAGIC = "SSHEETTR";
+
+const char* ToString(TraceOp op);
+
+// Лист, записывающий вызовы в трассу и передающий их листу sheet. Чтения
+// значений записываются через ячейки, возвращаемые GetCell: вызов GetValue у
+// такой ячейки - операция GetValue трассы. Ячейки остаются действительными,
+// пока существует объект. Вызовы, бросившие исключение, тоже записываются.
+//
+// Записи копятся в памяти и сбрасываются в поток пачками по FLUSH_BYTES и
+// при разрушении. Ошибка записи в поток бросает std::runtime_error.
+class RecordingSheet : public SheetInterface {
+public:
+    static const size_t FLUSH_BYTES = 1 << 16;
+
+    RecordingSheet(SheetInterface& sheet, std::ostream& trace);
+    ~RecordingSheet();
+
+    RecordingSheet(const RecordingSheet&) = delete;
+    RecordingSheet& operator=(const RecordingSheet&) = delete;
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    void ForEachCellInRange(const CellRange& range,
+                            const std::function<void(Position, const CellInterface&)>& action) const override;
+    std::optional<int> FindInColumn(int col, int first_row, int last_row, double key, bool exact) const override;
+    RangeSummary AggregateRange(const CellRange& range) const override;
+
+    void Flush();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Ячейка, записывающая чтения значения. Ячейку листа она ищет при каждом
+    // вызове: правки заменяют объекты ячеек.
+    class RecordedCell : public CellInterface {
+    public:
+        RecordedCell(const RecordingSheet& owner, Position pos);
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+        const RecordingSheet& owner_;
+        Position pos_;
+    };
+
+    CellInterface* GetRecordedCell(Position pos) const;
+    // Выполняет call и записывает операцию, даже если call бросил исключение
+    template <typename Call>
+    void Timed(TraceOp op, Position pos, std::string_view text, Call call) const;
+    void Append(TraceOp op, Clock::time_point start, Position pos = Position::NONE,
+                std::string_view text = {}) const;
+    void WritePending() const;
+
+    SheetInterface& sheet_;
+    std::ostream& trace_;
+    mutable Clock::time_point last_start_;
+    mutable std::string pending_;
+    mutable std::map<Position, RecordedCell> cells_;
+};
+
+// Гистограмма задержек. Каждая степень двойки делится на 4 корзины, так что
+// граница корзины отличается от попавших в неё значений не больше чем на 25%.
+class LatencyHistogram {
+public:
+    static const size_t BUCKETS = 4 * 48;
+
+    void Add(std::chrono::nanoseconds latency);
+
+    size_t Count() const;
+    std::chrono::nanoseconds Total() const;
+    std::chrono::nanoseconds Max() const;
+    // Верхняя граница корзины, в которую попадает доля fraction (0..1) всех
+    // задержек, но не больше максимальной задержки
+    std::chrono::nanoseconds Percentile(double fraction) const;
+    const std::array<size_t, BUCKETS>& Buckets() const;
+    // Нижняя граница корзины в наносекундах
+    static std::uint64_t BucketFloor(size_t bucket);
+
+private:
+    static size_t GetBucket(std::uint64_t ns);
+
+    std::array<size_t, BUCKETS> buckets_{};
+    size_t count_ = 0;
+    std::chrono::nanoseconds total_{0};
+    std::chrono::nanoseconds max_{0};
+};
+
+enum class ReplayPacing {
+    // Операции идут подряд без пауз
+    FullSpeed,
+    // Каждая операция начинается с тем же смещением от начала, что при записи
+    // (если предыдущие операции не задержали её)
+    Original,
+};
+
+struct ReplayReport {
+    // Задержки воспроизведения и записанные в трассе, по операциям
+    std::array<LatencyHistogram, TRACE_OP_COUNT> replayed;
+    std::array<LatencyHistogram, TRACE_OP_COUNT> recorded;
+    // Операции, бросившие исключение при воспроизведении
+    size_t failures = 0;
+    std::chrono::nanoseconds wall_time{0};
+
+    // Таблица по операциям: число вызовов, p50, p90, p99 и максимум
+    // задержки воспроизведения и записи, в микросекундах
+    void Print(std::ostream& output) const;
+};
+
+// Повторяет вызовы трассы на листе sheet. Печать выводится в никуда, чтения
+// вычисляют значения ячеек. Оборванная последняя запись отбрасывается;
+// неизвестная сигнатура или операция бросают std::runtime_error.
+ReplayReport ReplayTrace(std::istream& trace, SheetInterface& sheet,
+                         ReplayPacing pacing = ReplayPacing::FullSpeed);
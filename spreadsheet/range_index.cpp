@@ -0,0 +1,119 @@
+#include "range_index.h"
+
+std::uint64_t RangeIndex::Key(std::uint32_t col_node, std::uint32_t row_node) {
+    return (static_cast<std::uint64_t>(col_node) << 32) | row_node;
+}
+
+void RangeIndex::ForEachCanonical(int first, int last, int size,
+                                  const std::function<void(std::uint32_t)>& visit) {
+    std::uint32_t lo = static_cast<std::uint32_t>(first + size);
+    std::uint32_t hi = static_cast<std::uint32_t>(last + size + 1);
+    while (lo < hi) {
+        if (lo & 1) {
+            visit(lo++);
+        }
+        if (hi & 1) {
+            visit(--hi);
+        }
+        lo >>= 1;
+        hi >>= 1;
+    }
+}
+
+void RangeIndex::Add(const CellRange& range) {
+    // Некорректный диапазон не содержит ни одной позиции
+    if (!range.IsValid()) {
+        return;
+    }
+    ForEachCanonical(range.first.col, range.last.col, Position::MAX_COLS, [&](std::uint32_t col_node) {
+        ForEachCanonical(range.first.row, range.last.row, Position::MAX_ROWS, [&](std::uint32_t row_node) {
+            if (nodes_[Key(col_node, row_node)].insert(range).second) {
+                ++col_nodes_[col_node];
+            }
+        });
+    });
+}
+
+void RangeIndex::Remove(const CellRange& range) {
+    if (!range.IsValid()) {
+        return;
+    }
+    ForEachCanonical(range.first.col, range.last.col, Position::MAX_COLS, [&](std::uint32_t col_node) {
+        ForEachCanonical(range.first.row, range.last.row, Position::MAX_ROWS, [&](std::uint32_t row_node) {
+            auto it = nodes_.find(Key(col_node, row_node));
+            if (it == nodes_.end() || it->second.erase(range) == 0) {
+                return;
+            }
+            if (it->second.empty()) {
+                nodes_.erase(it);
+            }
+            auto count = col_nodes_.find(col_node);
+            if (--count->second == 0) {
+                col_nodes_.erase(count);
+            }
+        });
+    });
+}
+
+void RangeIndex::Clear() {
+    nodes_.clear();
+    col_nodes_.clear();
+}
+
+bool RangeIndex::Empty() const {
+    return nodes_.empty();
+}
+
+// Обходит узлы на путях от листьев pos к корням; visit возвращает true,
+// чтобы прервать поиск
+template <typename Visit>
+bool RangeIndex::FindContaining(Position pos, Visit visit) const {
+    if (nodes_.empty() || !pos.IsValid()) {
+        return false;
+    }
+    for (auto col_node = static_cast<std::uint32_t>(pos.col + Position::MAX_COLS); col_node > 0; col_node >>= 1) {
+        if (col_nodes_.count(col_node) == 0) {
+            continue;
+        }
+        for (auto row_node = static_cast<std::uint32_t>(pos.row + Position::MAX_ROWS); row_node > 0;
+             row_node >>= 1) {
+            auto it = nodes_.find(Key(col_node, row_node));
+            if (it == nodes_.end()) {
+                continue;
+            }
+            for (const CellRange& range : it->second) {
+                if (visit(range)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void RangeIndex::ForEachContaining(Position pos, const std::function<void(const CellRange&)>& visit) const {
+    FindContaining(pos, [&visit](const CellRange& range) {
+        visit(range);
+        return false;
+    });
+}
+
+bool RangeIndex::AnyContains(Position pos) const {
+    return FindContaining(pos, [](const CellRange&) {
+        return true;
+    });
+}
+
+size_t RangeIndex::MemoryUsage() const {
+    // Узлы хеш-таблиц: указатель на следующий узел, хеш и значение; узлы
+    // деревьев: три указателя, цвет и значение
+    const size_t hash_node = 2 * sizeof(void*);
+    const size_t tree_node = 4 * sizeof(void*);
+    size_t usage = nodes_.bucket_count() * sizeof(void*) + col_nodes_.bucket_count() * sizeof(void*)
+        + nodes_.size() * (hash_node + sizeof(decltype(nodes_)::value_type))
+        + col_nodes_.size() * (hash_node + sizeof(decltype(col_nodes_)::value_type));
+    for (const auto& [key, ranges] : nodes_) {
+        usage += ranges.size() * (tree_node + sizeof(CellRange));
+    }
+    return usage;
+}
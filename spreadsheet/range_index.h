@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <unordered_map>
+
+// Множество прямоугольных диапазонов листа с поиском диапазонов, содержащих
+// позицию. Строки и столбцы делятся деревом отрезков над [0, MAX_ROWS) и
+// [0, MAX_COLS); диапазон хранится в узлах пар (узел столбцов, узел строк)
+// из канонических разбиений своих отрезков - O(log^2 n) узлов. Позиция
+// лежит ровно в одном узле каждого из них на пути от листа к корню, так что
+// поиск перебирает O(log^2 n) узлов и выдаёт каждый диапазон один раз.
+// Узлы столбцов без диапазонов пропускаются: для диапазонов в одном столбце
+// поиск стоит O(log n) обращений к таблице плюс число найденных.
+class RangeIndex {
+public:
+    void Add(const CellRange& range);
+    void Remove(const CellRange& range);
+    void Clear();
+
+    bool Empty() const;
+    // Вызывает visit для каждого диапазона, содержащего pos
+    void ForEachContaining(Position pos, const std::function<void(const CellRange&)>& visit) const;
+    bool AnyContains(Position pos) const;
+
+    size_t MemoryUsage() const;
+
+private:
+    // Ключ узла: номер узла столбцов и номер узла строк (нумерация кучей,
+    // корень - 1)
+    static std::uint64_t Key(std::uint32_t col_node, std::uint32_t row_node);
+    // Узлы канонического разбиения отрезка [first, last] дерева над [0, size)
+    static void ForEachCanonical(int first, int last, int size, const std::function<void(std::uint32_t)>& visit);
+
+    template <typename Visit>
+    bool FindContaining(Position pos, Visit visit) const;
+
+    std::unordered_map<std::uint64_t, std::set<CellRange>> nodes_;
+    // Число записей в узлах строк под каждым узлом столбцов
+    std::unordered_map<std::uint32_t, size_t> col_nodes_;
+};
@@ -2,48 +2,152 @@
 
 #include "cell.h"
 #include "common.h"
+#include "edit_log.h"
+#include "trace.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <variant>
 
 using namespace std::literals;
 
+namespace {
+// Значение пустой позиции, на которую ссылаются формулы: такие позиции
+// хранятся в Sheet::empty_dependents_ без объекта Cell
+class EmptyCell : public CellInterface {
+public:
+    Value GetValue() const override {
+        return 0.0;
+    }
+    std::string GetText() const override {
+        return "";
+    }
+    std::vector<Position> GetReferencedCells() const override {
+        return {};
+    }
+};
+
+EmptyCell EMPTY_CELL;
+}
+
+Sheet::Sheet(Workbook& workbook, std::string name)
+    : workbook_(&workbook)
+    , name_(std::move(name)) {
+}
+
 Sheet::~Sheet() {}
 
-void Sheet::SetCell(Position pos, std::string text) {
-    CheckValid(pos);
-    if (!sheet_.count(pos) || sheet_.at(pos) == nullptr){
-        try {
-            sheet_[pos] = std::make_unique<Cell>(text,this,pos);
-        } catch (const CircularDependencyException& e) {
-            sheet_.erase(pos);
-            throw e;
-        }
-        for (auto pos_ : sheet_[pos]->GetReferencedCells()){
-            auto set_cells = GetRawCell(pos_)->GetDependentCells();
-            set_cells.insert(dynamic_cast<Cell*>(sheet_[pos].get()));
-            GetRawCell(pos_)->SetDependentCells(set_cells);
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    if (workbook_ == nullptr){
+        return nullptr;
+    }
+    return std::as_const(*workbook_).GetSheet(name);
+}
+
+Sheet* Sheet::ResolveSheet(std::string_view name) {
+    if (workbook_ == nullptr){
+        return nullptr;
+    }
+    return workbook_->GetSheet(name);
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+void Sheet::Recalculate() const {
+    EvaluateColumnRuns();
+    for (const auto& [pos,cell] : sheet_){
+        cell->GetValue();
+    }
+}
+
+EvaluationResult Sheet::GetValue(Position pos, const EvaluationLimits& limits) const {
+    auto cell = GetCell(pos);
+    if (cell == nullptr){
+        return {EvaluationStatus::Complete,0.0};
+    }
+    EvaluationLimitScope scope(limits);
+    try {
+        return {EvaluationStatus::Complete,cell->GetValue()};
+    } catch (const EvaluationInterrupted&){
+        return {EvaluationStatus::Partial,{}};
+    }
+}
+
+EvaluationStatus Sheet::Recalculate(const EvaluationLimits& limits) const {
+    EvaluationLimitScope scope(limits);
+    try {
+        Recalculate();
+    } catch (const EvaluationInterrupted&){
+        return EvaluationStatus::Partial;
+    }
+    return EvaluationStatus::Complete;
+}
+
+std::set<std::string> Sheet::GetReferencedSheets() const {
+    std::set<std::string> result;
+    for (const auto& [pos,cell] : sheet_){
+        for (const auto& ref : dynamic_cast<const Cell*>(cell.get())->GetExternalReferencedCellsView()){
+            result.insert(ref.sheet);
         }
     }
-    else {
-        if (sheet_.at(pos)->GetText() == text){
-            return;
+    return result;
+}
+
+void Sheet::LinkSheet(const std::string& name) {
+    Sheet* target = ResolveSheet(name);
+    std::vector<Cell*> linked;
+    for (const auto& [pos,cell] : sheet_){
+        auto raw = dynamic_cast<Cell*>(cell.get());
+        for (const auto& ref : raw->GetExternalReferencedCellsView()){
+            if (ref.sheet == name){
+                linked.push_back(raw);
+                break;
+            }
         }
-        GetRawCell(pos)->InvalidateCache();
-        auto dep_cells = dynamic_cast<Cell*>(sheet_[pos].get())->GetDependentCells();
-        auto old_text = sheet_[pos]->GetText();
-        sheet_[pos].reset();
-        try {
-            sheet_[pos] = std::make_unique<Cell>(text,this,pos);           
-        } catch (const CircularDependencyException& e){
-            sheet_[pos] = std::make_unique<Cell>(old_text,this,pos);
-            throw e;
+    }
+    // Регистрация может перестраивать таблицу зависимостей целевого листа,
+    // поэтому обход sheet_ и регистрация разделены (target может совпадать с this)
+    for (Cell* cell : linked){
+        for (const auto& ref : cell->GetExternalReferencedCellsView()){
+            if (ref.sheet == name){
+                target->AddDependent(ref.pos,cell);
+            }
         }
-        dynamic_cast<Cell*>(sheet_[pos].get())->SetDependentCells(dep_cells);
+        cell->InvalidateCache();
+    }
+    PublishChanges();
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    CheckValid(pos);
+    if (auto it = sheet_.find(pos); it != sheet_.end() && static_cast<Cell*>(it->second.get())->GetTextView() == text){
+        return;
     }
+    // Новая ячейка создаётся до удаления старой: если формула некорректна или
+    // образует цикл, исключение вылетит до изменения таблицы
+    auto cell = CreateCell(text,pos);
+    auto old_cell = SwapCell(pos,std::move(cell));
+    LogEdit(pos);
+    // Пустая ячейка на месте отсутствующей невидима, её не нужно отменять
+    if (old_cell != nullptr || !text.empty()){
+        RecordEdit(pos,std::move(old_cell));
+    }
+    if (memory_budget_ != 0 && ++edits_since_memory_check_ >= MEMORY_CHECK_INTERVAL){
+        TrimMemory();
+    }
+    PublishChanges();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -51,6 +155,9 @@ const CellInterface* Sheet::GetCell(Position pos) const {
     if (sheet_.count(pos) && sheet_.at(pos)!=nullptr /*&& sheet_.at(pos).get()->GetText() != ""*/){
         return sheet_.at(pos).get();
     }
+    if (empty_dependents_.count(PackPosition(pos))){
+        return &EMPTY_CELL;
+    }
     return nullptr;
     /*
     if (!sheet_.count(pos)){
@@ -70,6 +177,9 @@ CellInterface* Sheet::GetCell(Position pos) {
     if (sheet_.count(pos) && sheet_.at(pos)!=nullptr /*&& sheet_.at(pos).get()->GetText() != ""*/){
         return sheet_.at(pos).get();
     }
+    if (empty_dependents_.count(PackPosition(pos))){
+        return &EMPTY_CELL;
+    }
     return nullptr;
     /*
     if (!sheet_.count(pos)){
@@ -88,22 +198,20 @@ CellInterface* Sheet::GetCell(Position pos) {
 Cell* Sheet::GetRawCell(Position pos) {
     CheckValid(pos);
     if (!sheet_.count(pos)){
-        sheet_[pos] = std::make_unique<Cell>("",this,pos);
+        SwapCell(pos,CreateCell("",pos));
     }
-    return dynamic_cast<Cell*>(sheet_[pos].get());
+    return static_cast<Cell*>(sheet_.at(pos).get());
 }
 
 void Sheet::ClearCell(Position pos) {
     CheckValid(pos);
     if (sheet_.count(pos)){
-        GetRawCell(pos)->InvalidateCache();  
-        for (auto pos_ : sheet_[pos]->GetReferencedCells()){
-            auto set_cells = GetRawCell(pos_)->GetDependentCells();
-            set_cells.erase(dynamic_cast<Cell*>(sheet_[pos].get()));
-            GetRawCell(pos_)->SetDependentCells(set_cells);
+        auto old_cell = SwapCell(pos,nullptr);
+        if (!old_cell->GetTextView().empty()){
+            LogEdit(pos);
+            RecordEdit(pos,std::move(old_cell));
         }
-        sheet_[pos].reset();
-        sheet_.erase(pos);
+        PublishChanges();
     }
     /*
     if (sheet_.count(pos)){
@@ -123,7 +231,7 @@ Size Sheet::GetPrintableSize() const {
     int max_col = 0;
     bool flag = false;
     for (const auto& [pos,cell] : sheet_){
-        if (cell->GetText()!= ""){
+        if (!static_cast<const Cell*>(cell.get())->GetTextView().empty()){
             flag = true;
             max_row = std::max(max_row,pos.row);
             max_col = std::max(max_col,pos.col);
@@ -135,42 +243,190 @@ Size Sheet::GetPrintableSize() const {
     return {max_row+1,max_col+1};
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    Size max_size = GetPrintableSize();
-    for (int i = 0; i < max_size.rows; ++i){
-        for (int j = 0; j < max_size.cols; ++j){
-            if (GetCell({i,j}) != nullptr){ 
-                auto val = GetCell({i,j})->GetValue();
-                if (std::holds_alternative<FormulaError>(val)){
-                    output << std::get<FormulaError>(val); 
-                } else if (std::holds_alternative<double>(val)) {
-                    output << std::get<double>(val);
-                } else if (std::holds_alternative<std::string>(val)) {
-                    output << std::get<std::string>(val);
-                }
+void Sheet::EvaluateColumnRuns() const {
+    Trace::TraceSpan span("EvaluateColumnRuns");
+    std::map<int, std::vector<int>> rows_by_col;
+    for (const auto& [pos,cell] : sheet_){
+        auto raw = dynamic_cast<const Cell*>(cell.get());
+        if (raw != nullptr && raw->IsFormula() && !raw->HasCachedValue()){
+            rows_by_col[pos.col].push_back(pos.row);
+        }
+    }
+    for (auto& [col,rows] : rows_by_col){
+        std::sort(rows.begin(),rows.end());
+        ColumnKernel run_kernel;
+        int run_start = 0;
+        int run_length = 0;
+        auto flush = [&](){
+            if (run_length < MIN_COLUMN_RUN){
+                return;
+            }
+            CheckEvaluationLimits();
+            auto values = EvaluateColumnKernel(run_kernel,*this,run_start,run_length);
+            for (int i = 0; i < run_length; ++i){
+                auto cell = dynamic_cast<Cell*>(sheet_.at({run_start+i,col}).get());
+                std::visit([cell](const auto& value){ cell->SetCachedValue(value); },values[i]);
             }
-            if (j == max_size.cols-1){
-                output << '\n';
+        };
+        ColumnKernel kernel;
+        for (int row : rows){
+            auto cell = dynamic_cast<const Cell*>(sheet_.at({row,col}).get());
+            // ячейка могла быть вычислена как вход одной из предыдущих серий
+            bool compiled = !cell->HasCachedValue() && cell->CompileColumnKernel(kernel)
+                && !kernel.ReferencesColumn(col);
+            if (compiled && run_length > 0 && row == run_start+run_length && kernel == run_kernel){
+                ++run_length;
+                continue;
             }
-            else {
-                output << '\t';
+            flush();
+            run_length = 0;
+            if (compiled){
+                run_kernel = kernel;
+                run_start = row;
+                run_length = 1;
             }
         }
+        flush();
     }
 }
+
+void Sheet::PrintValue(std::ostream& output, const CellInterface::Value& val) {
+    if (std::holds_alternative<FormulaError>(val)){
+        output << std::get<FormulaError>(val); 
+    } else if (std::holds_alternative<double>(val)) {
+        output << std::get<double>(val);
+    } else if (std::holds_alternative<std::string>(val)) {
+        output << std::get<std::string>(val);
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintValues(output,size_t{0});
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
+    PrintTexts(output,size_t{0});
+}
+
+void Sheet::PrintValues(std::ostream& output, size_t max_threads) const {
+    Trace::TraceSpan span("PrintValues");
+    EvaluateColumnRuns();
     Size max_size = GetPrintableSize();
-    for (int i = 0; i < max_size.rows; ++i){
-        for (int j = 0; j < max_size.cols; ++j){
-            if (GetCell({i,j}) != nullptr){ 
-                output << GetCell({i,j})->GetText();
-            }
-            if (j == max_size.cols-1){
-                output << '\n';
+    if (max_size.rows > 0){
+        ExportRows(output,{{0,0},{max_size.rows-1,max_size.cols-1}},true,max_threads);
+    }
+}
+
+void Sheet::PrintTexts(std::ostream& output, size_t max_threads) const {
+    Trace::TraceSpan span("PrintTexts");
+    Size max_size = GetPrintableSize();
+    if (max_size.rows > 0){
+        ExportRows(output,{{0,0},{max_size.rows-1,max_size.cols-1}},false,max_threads);
+    }
+}
+
+// В отличие от печати всего листа, серии формул столбцов (EvaluateColumnRuns)
+// не вычисляются: они охватывают весь лист, а здесь вычисляются только ячейки
+// диапазона и, по мере надобности, их входы
+void Sheet::PrintValues(std::ostream& output, const CellRange& range) const {
+    Trace::TraceSpan span("PrintValues");
+    CheckValid(range);
+    PrintRows(output,range,true);
+}
+
+void Sheet::PrintTexts(std::ostream& output, const CellRange& range) const {
+    Trace::TraceSpan span("PrintTexts");
+    CheckValid(range);
+    PrintRows(output,range,false);
+}
+
+void Sheet::PrintRows(std::ostream& output, const CellRange& range, bool values) const {
+    for (int i = range.first.row; i <= range.last.row; ++i){
+        for (int j = range.first.col; j <= range.last.col; ++j){
+            if (values){
+                if (auto cell = GetCell({i,j})){
+                    PrintValue(output,cell->GetValue());
+                }
+            } else if (auto it = sheet_.find({i,j}); it != sheet_.end()){
+                output << static_cast<const Cell*>(it->second.get())->GetTextView();
             }
-            else {
-                output << '\t';
+            output << (j == range.last.col ? '\n' : '\t');
+        }
+    }
+}
+
+// Вычисление формул листа однопоточное (кэши и индексы столбцов заполняются
+// лениво), поэтому перед параллельной печатью значений лист вычисляется
+// целиком; после этого потоки только читают кэш. Блоки по EXPORT_BLOCK_ROWS
+// строк печатаются в свои буферы с форматом output и выводятся по порядку
+// волнами, чтобы в памяти было не больше нескольких блоков на поток.
+void Sheet::ExportRows(std::ostream& output, const CellRange& area, bool values, size_t max_threads) const {
+    if (max_threads == 0){
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const size_t rows = area.last.row-area.first.row+1;
+    const size_t blocks = (rows+EXPORT_BLOCK_ROWS-1)/EXPORT_BLOCK_ROWS;
+    if (max_threads == 1 || blocks == 1
+        || rows*(area.last.col-area.first.col+1) < PARALLEL_EXPORT_CELLS){
+        PrintRows(output,area,values);
+        return;
+    }
+    if (values){
+        Recalculate();
+    }
+    const size_t wave = max_threads*4;
+    std::vector<std::string> buffers(wave);
+    for (size_t wave_first = 0; wave_first < blocks; wave_first += wave){
+        const size_t wave_blocks = std::min(wave,blocks-wave_first);
+        std::atomic<size_t> next{0};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto worker = [&](){
+            for (size_t k = next++; k < wave_blocks; k = next++){
+                try {
+                    std::ostringstream out;
+                    out.copyfmt(output);
+                    // Ширина поля действует только на первый вывод
+                    if (wave_first+k > 0){
+                        out.width(0);
+                    }
+                    CellRange block = area;
+                    block.first.row = area.first.row+static_cast<int>((wave_first+k)*EXPORT_BLOCK_ROWS);
+                    block.last.row = std::min(area.last.row,block.first.row+EXPORT_BLOCK_ROWS-1);
+                    PrintRows(out,block,values);
+                    buffers[k] = std::move(out).str();
+                } catch (...){
+                    std::lock_guard lock(error_mutex);
+                    error = std::current_exception();
+                }
             }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::min(max_threads,wave_blocks); ++t){
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads){
+            thread.join();
+        }
+        if (error){
+            std::rethrow_exception(error);
+        }
+        for (size_t k = 0; k < wave_blocks; ++k){
+            output.write(buffers[k].data(),buffers[k].size());
+        }
+    }
+    output.width(0);
+}
+
+void Sheet::GetValues(const CellRange& range, std::vector<CellInterface::Value>& values) const {
+    CheckValid(range);
+    values.clear();
+    values.reserve(static_cast<size_t>(range.last.row-range.first.row+1)*(range.last.col-range.first.col+1));
+    for (int i = range.first.row; i <= range.last.row; ++i){
+        for (int j = range.first.col; j <= range.last.col; ++j){
+            auto cell = GetCell({i,j});
+            values.push_back(cell != nullptr ? cell->GetValue() : CellInterface::Value(0.0));
         }
     }
 }
@@ -179,6 +435,1138 @@ std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
 
+std::unique_ptr<Cell> Sheet::SwapCell(Position pos, std::unique_ptr<Cell> cell) {
+    std::set<Cell*> dep_cells;
+    std::unique_ptr<Cell> old_cell;
+    auto it = sheet_.find(pos);
+    if (it != sheet_.end()){
+        old_cell.reset(static_cast<Cell*>(it->second.release()));
+        sheet_.erase(it);
+        dep_cells = old_cell->GetDependentCells();
+        RemoveDependencies(old_cell.get());
+        old_cell->SetDependentCells({});
+    } else if (auto empty = empty_dependents_.find(PackPosition(pos)); empty != empty_dependents_.end()){
+        dep_cells.insert(empty->second.begin(),empty->second.end());
+        empty_dependents_.erase(empty);
+    }
+    // Внутри пачки кэш сбрасывается в FlushBatch: ячейки к тому времени могут
+    // быть заменены, поэтому запоминается позиция
+    if (batch_depth_ > 0){
+        batch_changes_.push_back(pos);
+    }
+    if (cell == nullptr){
+        // Зависимости пустой позиции переходят в таблицу empty_dependents_
+        if (!dep_cells.empty()){
+            empty_dependents_[PackPosition(pos)].assign(dep_cells.begin(),dep_cells.end());
+        }
+        if (batch_depth_ == 0){
+            std::vector<Cell*> dependents(dep_cells.begin(),dep_cells.end());
+            NotifyValueChanged(pos,dependents);
+            Cell::InvalidateCaches(dependents);
+        }
+    } else {
+        Cell* new_cell = cell.get();
+        sheet_[pos] = std::move(cell);
+        new_cell->SetDependentCells(dep_cells);
+        AddDependencies(new_cell);
+        if (batch_depth_ == 0){
+            new_cell->InvalidateCache();
+        }
+    }
+    return old_cell;
+}
+
+void Sheet::BeginBatch() {
+    ++batch_depth_;
+}
+
+void Sheet::EndBatch() {
+    if (batch_depth_ > 0 && --batch_depth_ == 0){
+        FlushBatch();
+        PublishChanges();
+    }
+}
+
+void Sheet::FlushBatch() {
+    std::vector<Position> positions = std::move(batch_changes_);
+    batch_changes_.clear();
+    std::sort(positions.begin(),positions.end());
+    positions.erase(std::unique(positions.begin(),positions.end()),positions.end());
+    std::vector<Cell*> cells;
+    for (Position pos : positions){
+        if (auto it = sheet_.find(pos); it != sheet_.end()){
+            cells.push_back(static_cast<Cell*>(it->second.get()));
+            continue;
+        }
+        if (auto empty = empty_dependents_.find(PackPosition(pos)); empty != empty_dependents_.end()){
+            cells.insert(cells.end(),empty->second.begin(),empty->second.end());
+        }
+        NotifyValueChanged(pos,cells);
+    }
+    if (!cells.empty()){
+        Cell::InvalidateCaches(cells);
+    }
+}
+
+void Sheet::BeginTransaction() {
+    ++transaction_depth_;
+}
+
+void Sheet::CommitTransaction() {
+    if (transaction_depth_ > 0 && --transaction_depth_ == 0){
+        EndTransaction();
+    }
+}
+
+void Sheet::EndTransaction() {
+    transaction_depth_ = 0;
+    transaction_open_ = false;
+    journal_overflow_ = false;
+    PublishChanges();
+}
+
+bool Sheet::CanUndo() const {
+    return !undo_.empty();
+}
+
+bool Sheet::CanRedo() const {
+    return !redo_.empty();
+}
+
+bool Sheet::Undo() {
+    EndTransaction();
+    if (undo_.empty()){
+        return false;
+    }
+    ApplyEdits(undo_.back(),true);
+    redo_.push_back(std::move(undo_.back()));
+    undo_.pop_back();
+    PublishChanges();
+    return true;
+}
+
+bool Sheet::Redo() {
+    EndTransaction();
+    if (redo_.empty()){
+        return false;
+    }
+    ApplyEdits(redo_.back(),false);
+    undo_.push_back(std::move(redo_.back()));
+    redo_.pop_back();
+    PublishChanges();
+    return true;
+}
+
+void Sheet::SetJournalLimit(size_t max_edits) {
+    journal_limit_ = max_edits;
+    TrimJournal();
+}
+
+void Sheet::ClearJournal() {
+    undo_.clear();
+    redo_.clear();
+    journal_size_ = 0;
+    transaction_open_ = false;
+}
+
+void Sheet::RecordEdit(Position pos, std::unique_ptr<Cell> old_cell) {
+    if (journal_limit_ == 0 || journal_overflow_){
+        return;
+    }
+    for (const auto& batch : redo_){
+        journal_size_ -= batch.size();
+    }
+    redo_.clear();
+    if (!transaction_open_){
+        undo_.emplace_back();
+        transaction_open_ = transaction_depth_ > 0;
+    }
+    undo_.back().push_back({pos,std::move(old_cell)});
+    ++journal_size_;
+    TrimJournal();
+}
+
+void Sheet::TrimJournal() {
+    while (journal_size_ > journal_limit_ && !undo_.empty()){
+        if (undo_.size() == 1 && transaction_open_){
+            // Открытая транзакция сама не помещается в журнал: отменить её
+            // целиком не получится, поэтому до её завершения правки не пишутся
+            journal_overflow_ = true;
+            transaction_open_ = false;
+        }
+        journal_size_ -= undo_.front().size();
+        undo_.pop_front();
+    }
+    if (journal_size_ > journal_limit_){
+        ClearJournal();
+    }
+}
+
+// Каждая правка меняет местами хранимую ячейку и текущую, так что после
+// прохода пакет описывает обратное действие. Цикл может возникнуть только
+// из-за правок на других листах книги; тогда уже применённые правки пакета
+// возвращаются обратно.
+void Sheet::ApplyEdits(EditBatch& batch, bool reverse) {
+    const size_t count = batch.size();
+    for (size_t i = 0; i < count; ++i){
+        EditDelta& delta = batch[reverse ? count-1-i : i];
+        try {
+            if (workbook_ != nullptr && delta.cell != nullptr){
+                delta.cell->CheckCircularDependency();
+            }
+        } catch (const CircularDependencyException&){
+            for (size_t j = i; j-- > 0;){
+                EditDelta& applied = batch[reverse ? count-1-j : j];
+                applied.cell = SwapCell(applied.pos,std::move(applied.cell));
+            }
+            throw;
+        }
+        delta.cell = SwapCell(delta.pos,std::move(delta.cell));
+    }
+    for (const EditDelta& delta : batch){
+        LogEdit(delta.pos);
+    }
+}
+
+void Sheet::ShiftJournalReferences(std::string_view sheet, const std::function<Position(Position)>& shift) {
+    auto shift_batch = [sheet,&shift](EditBatch& batch){
+        for (EditDelta& delta : batch){
+            if (delta.cell != nullptr){
+                delta.cell->ShiftExternalReferences(sheet,shift);
+            }
+        }
+    };
+    for (EditBatch& batch : undo_){
+        shift_batch(batch);
+    }
+    for (EditBatch& batch : redo_){
+        shift_batch(batch);
+    }
+}
+
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    SheetMemoryUsage usage;
+    usage.storage = sizeof(*this) + sheet_.bucket_count() * sizeof(void*)
+        + sheet_.size() * (sizeof(void*) + sizeof(decltype(sheet_)::value_type));
+    for (const auto& [pos,cell] : sheet_){
+        static_cast<const Cell*>(cell.get())->AddMemoryUsage(usage);
+    }
+    usage.dependencies += empty_dependents_.bucket_count() * sizeof(void*);
+    for (const auto& [key,dependents] : empty_dependents_){
+        usage.dependencies += sizeof(void*) + sizeof(decltype(empty_dependents_)::value_type)
+            + dependents.capacity() * sizeof(Cell*);
+    }
+    for (const auto& [range,dependents] : range_dependents_){
+        usage.dependencies += 4 * sizeof(void*) + sizeof(decltype(range_dependents_)::value_type)
+            + dependents.bucket_count() * sizeof(void*) + dependents.size() * 2 * sizeof(void*);
+    }
+    usage.dependencies += range_index_.MemoryUsage();
+    usage.cache += column_indexes_.bucket_count() * sizeof(void*);
+    for (const auto& [col,index] : column_indexes_){
+        usage.cache += sizeof(void*) + sizeof(col) + index.MemoryUsage();
+    }
+    auto add_batch = [&usage](const EditBatch& batch){
+        usage.storage += batch.capacity() * sizeof(EditDelta);
+        for (const auto& delta : batch){
+            if (delta.cell != nullptr){
+                delta.cell->AddMemoryUsage(usage);
+            }
+        }
+    };
+    for (const auto& batch : undo_){
+        add_batch(batch);
+    }
+    for (const auto& batch : redo_){
+        add_batch(batch);
+    }
+    usage.storage += shared_cells_.bucket_count() * sizeof(void*);
+    for (const auto& [text,cell] : shared_cells_){
+        usage.storage += sizeof(void*) + sizeof(decltype(shared_cells_)::value_type);
+        usage.text += text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+        cell->AddMemoryUsage(usage);
+    }
+    return usage;
+}
+
+void Sheet::SetMemoryBudget(size_t bytes) {
+    memory_budget_ = bytes;
+    TrimMemory();
+}
+
+size_t Sheet::TrimMemory() {
+    edits_since_memory_check_ = 0;
+    if (memory_budget_ == 0){
+        return 0;
+    }
+    size_t total = MemoryUsage().Total();
+    if (total <= memory_budget_){
+        return 0;
+    }
+    const size_t excess = total - memory_budget_;
+    size_t freed = 0;
+    // Первый проход снимает признак чтения и освобождает холодные ячейки,
+    // второй - все оставшиеся, если первого не хватило
+    for (int pass = 0; pass < 2 && freed < excess; ++pass){
+        for (auto& [pos,cell] : sheet_){
+            auto formula_cell = static_cast<Cell*>(cell.get());
+            if (!formula_cell->IsFormula() || formula_cell->ResetRecentlyUsed()){
+                continue;
+            }
+            freed += formula_cell->EvictCache();
+            if (freed >= excess){
+                break;
+            }
+        }
+    }
+    // Индексы столбцов строятся заново при следующем поиске
+    if (freed < excess && !column_indexes_.empty()){
+        for (const auto& [col,index] : column_indexes_){
+            freed += sizeof(void*) + sizeof(col) + index.MemoryUsage();
+        }
+        column_indexes_.clear();
+    }
+    return freed;
+}
+
+void Sheet::SetEditLog(EditLog* log) {
+    log_ = log;
+}
+
+EditLog* Sheet::GetEditLog() const {
+    return log_;
+}
+
+void Sheet::LogEdit(Position pos) {
+    if (log_ == nullptr){
+        return;
+    }
+    auto it = sheet_.find(pos);
+    std::string_view text = it != sheet_.end() ? static_cast<const Cell*>(it->second.get())->GetTextView() : "";
+    if (text.empty()){
+        log_->AppendClearCell(pos);
+    } else {
+        log_->AppendSetCell(pos,text);
+    }
+}
+
+void Sheet::LoadCells(const std::vector<std::pair<Position, std::string>>& cells) {
+    std::vector<std::string> expressions;
+    for (const auto& [pos,text] : cells){
+        CheckValid(pos);
+        if (text.size() > 1 && text[0] == FORMULA_SIGN){
+            expressions.push_back(text.substr(1));
+        }
+    }
+    auto formulas = ParseFormulas(expressions);
+    auto formula = formulas.begin();
+    for (const auto& [pos,text] : cells){
+        if (text.empty()){
+            SwapCell(pos,nullptr);
+        } else if (text.size() > 1 && text[0] == FORMULA_SIGN){
+            SwapCell(pos,CreateCell(std::move(*formula++),pos,false));
+        } else {
+            SwapCell(pos,CreateCell(text,pos,false));
+        }
+    }
+    ClearJournal();
+    PublishChanges();
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, const CellInterface&)>& action) const {
+    for (const auto& [pos,cell] : sheet_){
+        if (cell != nullptr && !static_cast<const Cell*>(cell.get())->GetTextView().empty()){
+            action(pos,*cell);
+        }
+    }
+}
+
+void Sheet::AddDependencies(Cell* cell) {
+    for (Position ref : cell->GetReferencedCellsView()){
+        AddDependent(ref,cell);
+    }
+    for (const auto& range : cell->GetReferencedRangesView()){
+        AddRangeDependent(range,cell);
+    }
+    for (const auto& ref : cell->GetExternalReferencedCellsView()){
+        if (Sheet* target = ResolveSheet(ref.sheet)){
+            target->AddDependent(ref.pos,cell);
+        }
+    }
+}
+
+void Sheet::RemoveDependencies(Cell* cell) {
+    for (Position ref : cell->GetReferencedCellsView()){
+        RemoveDependent(ref,cell);
+    }
+    for (const auto& range : cell->GetReferencedRangesView()){
+        auto it = range_dependents_.find(range);
+        if (it != range_dependents_.end() && it->second.erase(cell) && it->second.empty()){
+            range_index_.Remove(range);
+            range_dependents_.erase(it);
+        }
+    }
+    for (const auto& ref : cell->GetExternalReferencedCellsView()){
+        if (Sheet* target = ResolveSheet(ref.sheet)){
+            target->RemoveDependent(ref.pos,cell);
+        }
+    }
+}
+
+void Sheet::AddRangeDependent(const CellRange& range, Cell* dependent) {
+    auto [it,inserted] = range_dependents_.try_emplace(range);
+    if (inserted){
+        range_index_.Add(range);
+    }
+    it->second.insert(dependent);
+}
+
+std::uint32_t Sheet::PackPosition(Position pos) {
+    return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+}
+
+Position Sheet::UnpackPosition(std::uint32_t key) {
+    return {static_cast<int>(key / Position::MAX_COLS), static_cast<int>(key % Position::MAX_COLS)};
+}
+
+void Sheet::AddDependent(Position pos, Cell* dependent) {
+    if (auto it = sheet_.find(pos); it != sheet_.end()){
+        static_cast<Cell*>(it->second.get())->AddDependentCell(dependent);
+        return;
+    }
+    auto& dependents = empty_dependents_[PackPosition(pos)];
+    if (std::find(dependents.begin(),dependents.end(),dependent) == dependents.end()){
+        dependents.push_back(dependent);
+    }
+}
+
+void Sheet::RemoveDependent(Position pos, Cell* dependent) {
+    if (auto it = sheet_.find(pos); it != sheet_.end()){
+        static_cast<Cell*>(it->second.get())->RemoveDependentCell(dependent);
+        return;
+    }
+    auto it = empty_dependents_.find(PackPosition(pos));
+    if (it == empty_dependents_.end()){
+        return;
+    }
+    auto& dependents = it->second;
+    dependents.erase(std::remove(dependents.begin(),dependents.end(),dependent),dependents.end());
+    if (dependents.empty()){
+        empty_dependents_.erase(it);
+    }
+}
+
+bool Sheet::HasDependents(Position pos) const {
+    if (auto it = sheet_.find(pos); it != sheet_.end()){
+        if (static_cast<const Cell*>(it->second.get())->HasDependentCells()){
+            return true;
+        }
+    } else if (empty_dependents_.count(PackPosition(pos))){
+        return true;
+    }
+    return range_index_.AnyContains(pos);
+}
+
+void Sheet::NotifyValueChanged(Position pos, std::vector<Cell*>& dependents) {
+    if (!subscriptions_.empty()){
+        changed_cells_.push_back(pos);
+    }
+    if (auto it = column_indexes_.find(pos.col); it != column_indexes_.end()){
+        it->second.stale.insert(pos.row);
+    }
+    range_index_.ForEachContaining(pos,[this,&dependents](const CellRange& range){
+        const auto& cells = range_dependents_.at(range);
+        dependents.insert(dependents.end(),cells.begin(),cells.end());
+    });
+}
+
+namespace {
+// Объединяет позиции в непересекающиеся прямоугольники: сначала в отрезки
+// подряд идущих строк столбца, затем отрезки с одинаковыми строками в
+// соседних столбцах
+std::vector<CellRange> CoalescePositions(std::vector<Position> positions) {
+    std::sort(positions.begin(),positions.end(),[](Position lhs, Position rhs){
+        return std::tie(lhs.col,lhs.row) < std::tie(rhs.col,rhs.row);
+    });
+    positions.erase(std::unique(positions.begin(),positions.end()),positions.end());
+    std::vector<CellRange> runs;
+    for (Position pos : positions){
+        if (!runs.empty() && runs.back().last.col == pos.col && runs.back().last.row+1 == pos.row){
+            runs.back().last.row = pos.row;
+        } else {
+            runs.push_back({pos,pos});
+        }
+    }
+    std::sort(runs.begin(),runs.end(),[](const CellRange& lhs, const CellRange& rhs){
+        return std::tie(lhs.first.row,lhs.last.row,lhs.first.col)
+            < std::tie(rhs.first.row,rhs.last.row,rhs.first.col);
+    });
+    std::vector<CellRange> result;
+    for (const CellRange& run : runs){
+        if (!result.empty() && result.back().first.row == run.first.row
+            && result.back().last.row == run.last.row && result.back().last.col+1 == run.first.col){
+            result.back().last.col = run.last.col;
+        } else {
+            result.push_back(run);
+        }
+    }
+    std::sort(result.begin(),result.end());
+    return result;
+}
+
+std::optional<CellRange> Intersect(const CellRange& lhs, const CellRange& rhs) {
+    CellRange result{{std::max(lhs.first.row,rhs.first.row),std::max(lhs.first.col,rhs.first.col)},
+                     {std::min(lhs.last.row,rhs.last.row),std::min(lhs.last.col,rhs.last.col)}};
+    if (result.first.row > result.last.row || result.first.col > result.last.col){
+        return std::nullopt;
+    }
+    return result;
+}
+}
+
+size_t Sheet::Subscribe(const CellRange& area, ChangeCallback callback) {
+    if (!area.IsValid()){
+        throw InvalidPositionException("");
+    }
+    subscriptions_[next_subscription_] = {area,std::move(callback)};
+    if (workbook_ != nullptr){
+        ++workbook_->subscription_count_;
+    }
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    if (subscriptions_.erase(id) == 0){
+        return;
+    }
+    if (workbook_ != nullptr){
+        --workbook_->subscription_count_;
+    }
+    if (subscriptions_.empty()){
+        changed_cells_.clear();
+        changed_areas_.clear();
+    }
+}
+
+void Sheet::PublishChanges() {
+    if (workbook_ == nullptr){
+        PublishOwnChanges();
+        return;
+    }
+    // Изменения копятся только на листах с подписками
+    if (!workbook_->HasSubscriptions()){
+        return;
+    }
+    // Сброс кэша доходит до формул других листов, их подписчиков тоже
+    // нужно известить
+    for (const auto& name : workbook_->GetSheetNames()){
+        if (Sheet* sheet = ResolveSheet(name)){
+            sheet->PublishOwnChanges();
+        }
+    }
+}
+
+// Обработчик может менять лист и подписки, поэтому изменения и список
+// подписок забираются до вызовов
+void Sheet::PublishOwnChanges() {
+    if (transaction_depth_ > 0 || (changed_cells_.empty() && changed_areas_.empty())){
+        return;
+    }
+    std::vector<Position> cells = std::move(changed_cells_);
+    std::vector<CellRange> areas = std::move(changed_areas_);
+    changed_cells_.clear();
+    changed_areas_.clear();
+    std::vector<std::pair<size_t,CellRange>> subscriptions;
+    for (const auto& [id,subscription] : subscriptions_){
+        subscriptions.emplace_back(id,subscription.area);
+    }
+    for (const auto& [id,area] : subscriptions){
+        std::vector<CellRange> ranges;
+        for (const auto& changed : areas){
+            if (auto clipped = Intersect(changed,area)){
+                ranges.push_back(*clipped);
+            }
+        }
+        std::vector<Position> inside;
+        for (Position pos : cells){
+            bool covered = std::any_of(ranges.begin(),ranges.end(),[pos](const CellRange& range){
+                return range.Contains(pos);
+            });
+            if (area.Contains(pos) && !covered){
+                inside.push_back(pos);
+            }
+        }
+        auto coalesced = CoalescePositions(std::move(inside));
+        ranges.insert(ranges.end(),coalesced.begin(),coalesced.end());
+        auto it = subscriptions_.find(id);
+        if (ranges.empty() || it == subscriptions_.end()){
+            continue;
+        }
+        auto callback = it->second.callback;
+        callback(ranges);
+    }
+}
+
+void Sheet::ForEachCellInRange(const CellRange& range,
+                               const std::function<void(Position, const CellInterface&)>& action) const {
+    if (!range.IsValid()){
+        return;
+    }
+    // Диапазон больше числа ячеек листа выгоднее проверить обходом листа
+    size_t area = static_cast<size_t>(range.last.row-range.first.row+1)*(range.last.col-range.first.col+1);
+    if (area <= sheet_.size()){
+        SheetInterface::ForEachCellInRange(range,action);
+        return;
+    }
+    for (const auto& [pos,cell] : sheet_){
+        if (range.Contains(pos)){
+            action(pos,*cell);
+        }
+    }
+}
+
+Sheet::IndexValue Sheet::GetIndexValue(Position pos) const {
+    auto it = sheet_.find(pos);
+    if (it == sheet_.end() || static_cast<const Cell*>(it->second.get())->GetTextView().empty()){
+        return {};
+    }
+    auto value = it->second->GetValue();
+    if (std::holds_alternative<FormulaError>(value)){
+        return std::get<FormulaError>(value);
+    }
+    if (!std::holds_alternative<double>(value)){
+        return {};
+    }
+    // -0 и +0 равны, но могут давать разный хеш
+    double number = std::get<double>(value);
+    return number == 0.0 ? 0.0 : number;
+}
+
+void Sheet::ColumnIndex::Update(int row, const IndexValue& value) {
+    auto number = std::get_if<double>(&value);
+    bool error = std::holds_alternative<FormulaError>(value);
+    if (error){
+        errors.insert(row);
+    } else {
+        errors.erase(row);
+    }
+    if (has_aggregates){
+        aggregates.Set(row,number != nullptr ? std::optional<double>(*number) : std::nullopt,error);
+    }
+    if (auto old = values.find(row); old != values.end()){
+        auto erase_row = [row](auto& index, double key){
+            auto it = index.find(key);
+            it->second.erase(row);
+            if (it->second.empty()){
+                index.erase(it);
+            }
+        };
+        if (has_exact){
+            erase_row(exact,old->second);
+        }
+        if (has_sorted){
+            erase_row(sorted,old->second);
+        }
+        values.erase(old);
+    }
+    if (number != nullptr){
+        values[row] = *number;
+        if (has_exact){
+            exact[*number].insert(row);
+        }
+        if (has_sorted){
+            sorted[*number].insert(row);
+        }
+    }
+}
+
+std::vector<std::pair<int, int>> Sheet::ColumnIndex::GetUncovered(int first_row, int last_row) const {
+    std::vector<std::pair<int, int>> gaps;
+    int row = first_row;
+    auto it = covered.upper_bound(first_row);
+    if (it != covered.begin()){
+        row = std::max(row,std::prev(it)->second+1);
+    }
+    for (; row <= last_row; ++it){
+        int end = it == covered.end() ? last_row : std::min(last_row,it->first-1);
+        if (row <= end){
+            gaps.emplace_back(row,end);
+        }
+        if (it == covered.end()){
+            break;
+        }
+        row = std::max(row,it->second+1);
+    }
+    return gaps;
+}
+
+void Sheet::ColumnIndex::Cover(int first_row, int last_row) {
+    auto it = covered.upper_bound(first_row);
+    if (it != covered.begin() && std::prev(it)->second+1 >= first_row){
+        --it;
+        first_row = it->first;
+        last_row = std::max(last_row,it->second);
+        it = covered.erase(it);
+    }
+    while (it != covered.end() && it->first <= last_row+1){
+        last_row = std::max(last_row,it->second);
+        it = covered.erase(it);
+    }
+    covered.emplace(first_row,last_row);
+}
+
+Sheet::ColumnIndex& Sheet::GetColumnIndex(int col, int first_row, int last_row) const {
+    // Значения читаются до изменения индекса: чтение может вычислять формулы,
+    // которые сами обращаются к индексу этого столбца
+    std::vector<int> rows;
+    std::vector<std::pair<int, int>> gaps;
+    auto it = column_indexes_.find(col);
+    if (it == column_indexes_.end()){
+        gaps.emplace_back(first_row,last_row);
+    } else {
+        gaps = it->second.GetUncovered(first_row,last_row);
+        const auto& stale = it->second.stale;
+        rows.assign(stale.lower_bound(first_row),stale.upper_bound(last_row));
+    }
+    for (const auto& [first,last] : gaps){
+        ForEachCellInRange({{first,col},{last,col}},[&rows](Position pos, const CellInterface&){
+            rows.push_back(pos.row);
+        });
+    }
+    std::vector<std::pair<int, IndexValue>> updates;
+    for (int row : rows){
+        updates.emplace_back(row,GetIndexValue({row,col}));
+    }
+    ColumnIndex& index = column_indexes_[col];
+    for (const auto& [row,value] : updates){
+        index.Update(row,value);
+        index.stale.erase(row);
+    }
+    if (first_row <= last_row){
+        index.Cover(first_row,last_row);
+    }
+    return index;
+}
+
+std::optional<int> Sheet::FindInColumn(int col, int first_row, int last_row, double key, bool exact) const {
+    Trace::TraceSpan span("FindInColumn");
+    ColumnIndex& index = GetColumnIndex(col,first_row,last_row);
+    key = key == 0.0 ? 0.0 : key;
+    if (exact){
+        if (!index.has_exact){
+            for (const auto& [row,value] : index.values){
+                index.exact[value].insert(row);
+            }
+            index.has_exact = true;
+        }
+        auto found = index.exact.find(key);
+        if (found == index.exact.end()){
+            return std::nullopt;
+        }
+        auto row = found->second.lower_bound(first_row);
+        if (row == found->second.end() || *row > last_row){
+            return std::nullopt;
+        }
+        return *row;
+    }
+    if (!index.has_sorted){
+        for (const auto& [row,value] : index.values){
+            index.sorted[value].insert(row);
+        }
+        index.has_sorted = true;
+    }
+    // Значения, у которых нет строк в диапазоне, пропускаются
+    for (auto found = index.sorted.upper_bound(key); found != index.sorted.begin();){
+        --found;
+        auto row = found->second.upper_bound(last_row);
+        if (row != found->second.begin() && *std::prev(row) >= first_row){
+            return *std::prev(row);
+        }
+    }
+    return std::nullopt;
+}
+
+RangeSummary Sheet::AggregateRange(const CellRange& range) const {
+    Trace::TraceSpan span("AggregateRange");
+    RangeSummary summary;
+    if (!range.IsValid()){
+        return summary;
+    }
+    for (int col = range.first.col; col <= range.last.col; ++col){
+        ColumnIndex& index = GetColumnIndex(col,range.first.row,range.last.row);
+        if (!index.has_aggregates){
+            for (const auto& [row,value] : index.values){
+                index.aggregates.Set(row,value,false);
+            }
+            for (int row : index.errors){
+                index.aggregates.Set(row,std::nullopt,true);
+            }
+            index.has_aggregates = true;
+        }
+        auto column = index.aggregates.Query(range.first.row,range.last.row);
+        summary.sum += column.sum;
+        summary.count += column.count;
+        summary.min = std::min(summary.min,column.min);
+        summary.max = std::max(summary.max,column.max);
+        if (column.errors > 0 && !summary.error){
+            // Значение ошибки уже вычислено при индексации
+            int row = *index.errors.lower_bound(range.first.row);
+            summary.error = std::get<FormulaError>(GetCell({row,col})->GetValue());
+        }
+    }
+    return summary;
+}
+
+size_t Sheet::ColumnIndex::MemoryUsage() const {
+    // Узлы хеш-таблиц: указатель на следующий узел, хеш и значение; узлы
+    // деревьев: три указателя, цвет и значение
+    const size_t hash_node = 2 * sizeof(void*);
+    const size_t tree_node = 4 * sizeof(void*);
+    size_t usage = sizeof(ColumnIndex) + values.bucket_count() * sizeof(void*)
+        + values.size() * (hash_node + sizeof(std::pair<const int, double>))
+        + stale.size() * (tree_node + sizeof(int)) + errors.size() * (tree_node + sizeof(int))
+        + covered.size() * (tree_node + sizeof(std::pair<const int, int>)) + aggregates.MemoryUsage();
+    usage += exact.bucket_count() * sizeof(void*)
+        + exact.size() * (hash_node + sizeof(decltype(exact)::value_type));
+    usage += sorted.size() * (tree_node + sizeof(decltype(sorted)::value_type));
+    // каждая строка входит в множество строк в обоих индексах
+    usage += values.size() * (tree_node + sizeof(int)) * (has_exact + has_sorted);
+    return usage;
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (before < 0 || before >= Position::MAX_ROWS || count < 0){
+        throw InvalidPositionException("");
+    }
+    ShiftCells(true,before,count);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    if (first < 0 || first >= Position::MAX_ROWS || count < 0){
+        throw InvalidPositionException("");
+    }
+    ShiftCells(true,first,-std::min(count,Position::MAX_ROWS-first));
+}
+
+void Sheet::InsertCols(int before, int count) {
+    if (before < 0 || before >= Position::MAX_COLS || count < 0){
+        throw InvalidPositionException("");
+    }
+    ShiftCells(false,before,count);
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    if (first < 0 || first >= Position::MAX_COLS || count < 0){
+        throw InvalidPositionException("");
+    }
+    ShiftCells(false,first,-std::min(count,Position::MAX_COLS-first));
+}
+
+// Перемещаются только ячейки за линией first, и переписываются только формулы,
+// которые на них ссылаются (их находим по спискам зависимых). Значения при
+// вставке не меняются, поэтому кэш сбрасывается только у формул, ссылавшихся
+// на удалённые ячейки.
+void Sheet::ShiftCells(bool rows, int first, int delta) {
+    if (delta == 0){
+        return;
+    }
+    // Сдвиг меняет позиции, накопленные в пачке
+    FlushBatch();
+    auto shift = [rows,first,delta](Position pos){
+        int& coord = rows ? pos.row : pos.col;
+        if (coord < first){
+            return pos;
+        }
+        if (coord < first-delta){
+            return Position::NONE;
+        }
+        coord += delta;
+        return pos.IsValid() ? pos : Position::NONE;
+    };
+
+    std::vector<Position> moved;
+    std::vector<Position> removed;
+    for (const auto& [pos,cell] : sheet_){
+        if ((rows ? pos.row : pos.col) < first){
+            continue;
+        }
+        if (shift(pos).IsValid()){
+            moved.push_back(pos);
+        } else if (delta > 0 && !static_cast<const Cell*>(cell.get())->GetTextView().empty()){
+            throw InvalidPositionException("");
+        } else {
+            // при вставке за край таблицы может уйти только пустая ячейка:
+            // ссылки на неё станут #REF!
+            removed.push_back(pos);
+        }
+    }
+    // Позиции в журнале отмены после сдвига устарели
+    ClearJournal();
+    // Ссылки скрытых ячеек общих подвыражений не сдвигаются
+    UnshareCommonSubexpressions();
+
+    std::unordered_set<Cell*> to_rewrite;
+    std::unordered_set<Cell*> to_invalidate;
+    for (Position pos : moved){
+        for (Cell* dep : static_cast<Cell*>(sheet_.at(pos).get())->GetDependentCells()){
+            to_rewrite.insert(dep);
+        }
+    }
+    for (Position pos : removed){
+        Cell* cell = static_cast<Cell*>(sheet_.at(pos).get());
+        for (Cell* dep : cell->GetDependentCells()){
+            to_rewrite.insert(dep);
+            to_invalidate.insert(dep);
+        }
+        RemoveDependencies(cell);
+    }
+    for (Position pos : removed){
+        Cell* cell = static_cast<Cell*>(sheet_.at(pos).get());
+        to_rewrite.erase(cell);
+        to_invalidate.erase(cell);
+        sheet_.erase(pos);
+    }
+
+    // Диапазоны, заходящие за линию first, сдвигаются или меняют размер:
+    // такие формулы переписываются и пересчитываются, их диапазоны
+    // регистрируются заново после сдвига
+    std::vector<Cell*> range_cells;
+    for (auto it = range_dependents_.begin(); it != range_dependents_.end();){
+        if ((rows ? it->first.last.row : it->first.last.col) < first){
+            ++it;
+            continue;
+        }
+        for (Cell* dep : it->second){
+            to_rewrite.insert(dep);
+            to_invalidate.insert(dep);
+            range_cells.push_back(dep);
+        }
+        range_index_.Remove(it->first);
+        it = range_dependents_.erase(it);
+    }
+    column_indexes_.clear();
+
+    // Зависимости пустых позиций сдвигаются так же, как ячейки
+    std::vector<std::pair<Position, std::vector<Cell*>>> moved_empty;
+    for (auto it = empty_dependents_.begin(); it != empty_dependents_.end();){
+        Position pos = UnpackPosition(it->first);
+        if ((rows ? pos.row : pos.col) < first){
+            ++it;
+            continue;
+        }
+        Position target = shift(pos);
+        for (Cell* dep : it->second){
+            to_rewrite.insert(dep);
+            if (!target.IsValid()){
+                to_invalidate.insert(dep);
+            }
+        }
+        if (target.IsValid()){
+            moved_empty.emplace_back(target,std::move(it->second));
+        }
+        it = empty_dependents_.erase(it);
+    }
+    for (auto& [pos,dependents] : moved_empty){
+        empty_dependents_[PackPosition(pos)] = std::move(dependents);
+    }
+
+    // Сначала извлекаем все узлы, чтобы новые ключи не столкнулись со старыми
+    std::vector<decltype(sheet_)::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (Position pos : moved){
+        nodes.push_back(sheet_.extract(pos));
+    }
+    for (auto& node : nodes){
+        node.key() = shift(node.key());
+        static_cast<Cell*>(node.mapped().get())->SetPosition(node.key());
+        sheet_.insert(std::move(node));
+    }
+
+    // Зависимыми могут быть и формулы других листов книги: у них сдвигаются
+    // только ссылки на этот лист
+    for (Cell* cell : to_rewrite){
+        if (cell->GetSheet() == this){
+            cell->ShiftReferences(shift);
+        }
+        if (workbook_ != nullptr){
+            cell->ShiftExternalReferences(name_,shift);
+        }
+    }
+    // Журналы других листов хранят вытесненные ячейки, не связанные с этим
+    // листом: ссылки в них сдвигаются, чтобы отмена вернула верные формулы
+    if (workbook_ != nullptr){
+        for (const auto& name : workbook_->GetSheetNames()){
+            Sheet* sheet = ResolveSheet(name);
+            if (sheet != nullptr && sheet != this){
+                sheet->ShiftJournalReferences(name_,shift);
+            }
+        }
+    }
+    for (Cell* cell : range_cells){
+        for (const auto& range : cell->GetReferencedRangesView()){
+            AddRangeDependent(range,cell);
+        }
+    }
+    Cell::InvalidateCaches({to_invalidate.begin(),to_invalidate.end()});
+    if (log_ != nullptr){
+        log_->AppendShift(rows,first,delta);
+    }
+    // Значения за линией first сместились целиком
+    if (!subscriptions_.empty()){
+        changed_areas_.push_back(rows
+            ? CellRange{{first,0},{Position::MAX_ROWS-1,Position::MAX_COLS-1}}
+            : CellRange{{0,first},{Position::MAX_ROWS-1,Position::MAX_COLS-1}});
+    }
+    PublishChanges();
+}
+
+// Скрытая ячейка создаётся при первой замене её подвыражения. Затем
+// размечаются и формулы скрытых ячеек, но только уже созданными ячейками:
+// иначе подвыражения, встречающиеся лишь внутри одного общего, получили бы
+// по собственной ячейке.
+size_t Sheet::ShareCommonSubexpressions() {
+    UnshareCommonSubexpressions();
+    std::unordered_map<std::string,size_t> counts;
+    for (const auto& [pos,cell] : sheet_){
+        static_cast<const Cell*>(cell.get())->ForEachSubexpression([&counts](const std::string& text){
+            ++counts[text];
+        });
+    }
+    for (auto& [pos,cell] : sheet_){
+        static_cast<Cell*>(cell.get())->ShareSubexpressions([this,&counts](const std::string& text) -> const CellInterface* {
+            auto count = counts.find(text);
+            if (count == counts.end() || count->second < 2){
+                return nullptr;
+            }
+            auto [it,inserted] = shared_cells_.try_emplace(text);
+            if (inserted){
+                it->second = CreateCell(FORMULA_SIGN+text,Position::NONE,false);
+                AddDependencies(it->second.get());
+            }
+            return it->second.get();
+        });
+    }
+    for (auto& [text,cell] : shared_cells_){
+        cell->ShareSubexpressions([this,&text = text](const std::string& subexpression) -> const CellInterface* {
+            auto it = shared_cells_.find(subexpression);
+            if (it == shared_cells_.end() || subexpression == text){
+                return nullptr;
+            }
+            return it->second.get();
+        });
+    }
+    return shared_cells_.size();
+}
+
+void Sheet::UnshareCommonSubexpressions() {
+    if (shared_cells_.empty()){
+        return;
+    }
+    for (auto& [pos,cell] : sheet_){
+        static_cast<Cell*>(cell.get())->UnshareSubexpressions();
+    }
+    auto unshare_batch = [](EditBatch& batch){
+        for (auto& delta : batch){
+            if (delta.cell != nullptr){
+                delta.cell->UnshareSubexpressions();
+            }
+        }
+    };
+    std::for_each(undo_.begin(),undo_.end(),unshare_batch);
+    std::for_each(redo_.begin(),redo_.end(),unshare_batch);
+    for (auto& [text,cell] : shared_cells_){
+        RemoveDependencies(cell.get());
+    }
+    shared_cells_.clear();
+}
+
+std::unique_ptr<Cell> Sheet::CreateCell(const std::string& text, Position pos, bool check_cycles) {
+    auto cell = std::make_unique<Cell>(text,this,pos,check_cycles);
+    if (profiling_){
+        cell->EnableProfiling(true);
+    }
+    return cell;
+}
+
+std::unique_ptr<Cell> Sheet::CreateCell(std::unique_ptr<FormulaInterface> formula, Position pos, bool check_cycles) {
+    auto cell = std::make_unique<Cell>(std::move(formula),this,pos,check_cycles);
+    if (profiling_){
+        cell->EnableProfiling(true);
+    }
+    return cell;
+}
+
+void Sheet::EnableProfiling(bool enable) {
+    profiling_ = enable;
+    for (auto& [pos,cell] : sheet_){
+        if (cell != nullptr){
+            dynamic_cast<Cell*>(cell.get())->EnableProfiling(enable);
+        }
+    }
+}
+
+std::vector<CellProfileEntry> Sheet::ProfileReport(size_t n) const {
+    std::vector<std::pair<Position,const Cell*>> cells;
+    for (const auto& [pos,cell] : sheet_){
+        auto raw = dynamic_cast<const Cell*>(cell.get());
+        if (raw != nullptr && raw->IsFormula() && raw->GetProfile() != nullptr){
+            cells.emplace_back(pos,raw);
+        }
+    }
+    n = std::min(n,cells.size());
+    std::partial_sort(cells.begin(),cells.begin()+n,cells.end(),[](const auto& lhs, const auto& rhs){
+        const CellProfile& l = *lhs.second->GetProfile();
+        const CellProfile& r = *rhs.second->GetProfile();
+        return std::tie(l.exclusive,l.inclusive,rhs.first) > std::tie(r.exclusive,r.inclusive,lhs.first);
+    });
+    std::vector<CellProfileEntry> result;
+    result.reserve(n);
+    std::unordered_map<Position, int, PositionHasher> depths;
+    for (size_t i = 0; i < n; ++i){
+        auto [pos,cell] = cells[i];
+        result.push_back({pos,cell->GetText(),*cell->GetProfile(),GetDependencyDepth(pos,depths)});
+    }
+    return result;
+}
+
+// Глубина считается обходом в глубину с явным стеком, чтобы длинные цепочки
+// не переполняли стек вызовов. Циклов в таблице нет.
+int Sheet::GetDependencyDepth(Position pos, std::unordered_map<Position, int, PositionHasher>& depths) const {
+    std::vector<std::pair<Position,bool>> stack = {{pos,false}};
+    while (!stack.empty()){
+        auto [current,expanded] = stack.back();
+        stack.pop_back();
+        if (depths.count(current)){
+            continue;
+        }
+        auto it = sheet_.find(current);
+        Span<Position> refs;
+        if (it != sheet_.end()){
+            refs = static_cast<const Cell*>(it->second.get())->GetReferencedCellsView();
+        }
+        if (!expanded){
+            stack.push_back({current,true});
+            for (Position ref : refs){
+                if (!depths.count(ref)){
+                    stack.push_back({ref,false});
+                }
+            }
+            continue;
+        }
+        int depth = 0;
+        for (Position ref : refs){
+            depth = std::max(depth,depths.at(ref)+1);
+        }
+        depths[current] = depth;
+    }
+    return depths.at(pos);
+}
+
+void Sheet::CheckValid(const CellRange& range) const {
+    if (!range.IsValid() || range.first.row > range.last.row || range.first.col > range.last.col){
+        throw InvalidPositionException("");
+    }
+}
+
 void Sheet::CheckValid(Position pos) const {
     if (!pos.IsValid()){
         throw InvalidPositionException("");
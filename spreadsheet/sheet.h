@@ -1,11 +1,19 @@
 #pragma once
 
 #include "cell.h"
+#include "column_aggregates.h"
 #include "common.h"
+#include "evaluation_limits.h"
+#include "range_index.h"
 
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <optional>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <variant>
 
 struct PositionHasher {
     public:
@@ -16,8 +24,23 @@ struct PositionHasher {
         }
 };
 
+// Строка отчёта профилировщика
+struct CellProfileEntry {
+    Position pos;
+    std::string text;
+    CellProfile profile;
+    // Длина самой длинной цепочки ссылок от ячейки до ячейки без формулы
+    int depth = 0;
+};
+
+class EditLog;
+class Workbook;
+
 class Sheet : public SheetInterface {
 public:
+    Sheet() = default;
+    // Лист книги: ссылки вида Имя!A1 ищутся среди листов workbook
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
@@ -31,12 +54,308 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // То же в max_threads потоках (0 - по числу ядер). Печатная область
+    // делится на блоки строк, блоки форматируются параллельно и выводятся по
+    // порядку; результат совпадает с однопоточной печатью. Небольшие листы
+    // (меньше PARALLEL_EXPORT_CELLS позиций) печатаются в одном потоке.
+    void PrintValues(std::ostream& output, size_t max_threads) const;
+    void PrintTexts(std::ostream& output, size_t max_threads) const;
+
+    static const size_t PARALLEL_EXPORT_CELLS = 1 << 16;
+    static const int EXPORT_BLOCK_ROWS = 256;
+    // Печать только ячеек range (по строкам и столбцам range, в формате
+    // печати всего листа). Вычисляются только формулы диапазона и их входы,
+    // остальные формулы листа остаются невычисленными.
+    void PrintValues(std::ostream& output, const CellRange& range) const;
+    void PrintTexts(std::ostream& output, const CellRange& range) const;
+    // Значения ячеек range построчно в буфер вызывающего (предыдущее
+    // содержимое заменяется, ёмкость переиспользуется). Пустые позиции имеют
+    // значение 0. Вычисляется так же, как PrintValues(output, range).
+    void GetValues(const CellRange& range, std::vector<CellInterface::Value>& values) const;
 
+    // Возвращает ячейку позиции, при необходимости создавая пустую
     Cell* GetRawCell(Position pos);
 
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    const std::string& GetName() const;
+
+    void ForEachCellInRange(const CellRange& range,
+                            const std::function<void(Position, const CellInterface&)>& action) const override;
+    // Поиск идёт по индексам столбца (см. ColumnIndex): точное совпадение -
+    // за O(1), приближённое - за O(log n). Индекс строится при первом поиске
+    // в столбце и обновляется по изменённым строкам.
+    std::optional<int> FindInColumn(int col, int first_row, int last_row, double key, bool exact) const override;
+    // Сводка собирается по агрегатам столбцов (см. ColumnAggregates) за
+    // O(log n) на столбец диапазона
+    RangeSummary AggregateRange(const CellRange& range) const override;
+    // Вызывается при сбросе значения ячейки pos: помечает строку в индексе
+    // столбца устаревшей и добавляет в dependents формулы, ссылающиеся на pos
+    // через диапазоны, чтобы обход сбросил и их
+    void NotifyValueChanged(Position pos, std::vector<Cell*>& dependents);
+    // Есть ли формулы, ссылающиеся на pos напрямую или через диапазон
+    bool HasDependents(Position pos) const;
+
+    // Вычисляет все формулы листа
+    void Recalculate() const;
+    // Значение ячейки и пересчёт листа с ограничением по сроку или отмене.
+    // Ограничения проверяются перед вычислением каждой формулы. Если они
+    // исчерпаны, возвращается EvaluationStatus::Partial: вычисленные ячейки
+    // сохраняют значения, остальные остаются невычисленными.
+    EvaluationResult GetValue(Position pos, const EvaluationLimits& limits) const;
+    EvaluationStatus Recalculate(const EvaluationLimits& limits) const;
+    // Имена листов, на которые ссылаются формулы этого листа
+    std::set<std::string> GetReferencedSheets() const;
+    // Регистрирует зависимости формул от ячеек только что добавленного листа
+    // и сбрасывает их кэш: до этого такие ссылки вычислялись как #REF!
+    void LinkSheet(const std::string& name);
+
+    // Режим профилирования: для каждой формульной ячейки собирается время
+    // вычисления, число вычислений и инвалидаций.
+    void EnableProfiling(bool enable);
+    // Возвращает n ячеек с наибольшим собственным временем вычисления
+    std::vector<CellProfileEntry> ProfileReport(size_t n) const;
+
+    // Вставляют count пустых строк (столбцов) перед строкой (столбцом) before
+    // или удаляют count строк (столбцов), начиная с first. Ячейки сдвигаются
+    // вместе с ссылками на них в формулах, формулы не разбираются заново.
+    // Ссылки на удалённые ячейки вычисляются как #REF!. Если при вставке
+    // непустая ячейка выходит за пределы таблицы, бросается
+    // InvalidPositionException и таблица не изменяется.
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Журнал отмены. Каждый SetCell/ClearCell - отдельная правка, правки между
+    // BeginTransaction и CommitTransaction (допускается вложенность)
+    // отменяются вместе. Правка хранит позицию и вытесненную ячейку; отмена
+    // меняет её местами с текущей без повторного разбора формулы. Вставка и
+    // удаление строк и столбцов очищают журнал. Undo и Redo сначала
+    // завершают открытую транзакцию на любой глубине вложенности.
+    void BeginTransaction();
+    void CommitTransaction();
+    bool Undo();
+    bool Redo();
+    bool CanUndo() const;
+    bool CanRedo() const;
+    // Максимальное число правок (ячеек) в журнале. Старые правки вытесняются
+    // целыми транзакциями; 0 отключает журнал.
+    void SetJournalLimit(size_t max_edits);
+
+    static const size_t DEFAULT_JOURNAL_LIMIT = 100000;
+
+    // Пачка правок. SetCell/ClearCell между BeginBatch и EndBatch (допускается
+    // вложенность) не сбрасывают кэш зависимых формул: EndBatch сбрасывает
+    // его одним обходом от всех изменённых позиций, так что общие зависимые
+    // обходятся один раз. До EndBatch значения формул, зависящих от правок
+    // пачки, устарели, их нельзя читать. Вставка и удаление строк и столбцов
+    // сначала сбрасывают накопленное.
+    void BeginBatch();
+    void EndBatch();
+
+    // Подписка на изменения значений в прямоугольнике area. callback получает
+    // прямоугольники внутри area, покрывающие ячейки, значения которых могли
+    // измениться: изменённые ячейки и формулы, зависящие от них (в том числе
+    // с других листов книги). Список собирается при сбросе кэша, соседние
+    // ячейки объединяются в прямоугольники. callback вызывается после каждой
+    // правки, Undo/Redo, загрузки и вставки/удаления строк и столбцов, а
+    // внутри транзакции - один раз при её завершении; без изменений в area не
+    // вызывается.
+    using ChangeCallback = std::function<void(const std::vector<CellRange>&)>;
+    size_t Subscribe(const CellRange& area, ChangeCallback callback);
+    void Unsubscribe(size_t id);
+
+    // Оценка памяти, занятой листом, включая ячейки в журнале отмены
+    SheetMemoryUsage MemoryUsage() const;
+    // Ограничение памяти листа в байтах (0 - без ограничения). При превышении
+    // у давно не читавшихся формул сбрасываются кэшированные значения и
+    // упрощённые деревья (алгоритм "часы": ячейка, прочитанная после прошлого
+    // обхода, получает второй шанс); значения вычисляются заново при
+    // обращении. Ограничение проверяется каждые MEMORY_CHECK_INTERVAL правок
+    // и при вызове TrimMemory.
+    void SetMemoryBudget(size_t bytes);
+    // Возвращает число освобождённых байт
+    size_t TrimMemory();
+
+    static const size_t MEMORY_CHECK_INTERVAL = 1024;
+
+    // Подключает журнал упреждающей записи (nullptr - отключает): в него
+    // пишутся все изменения листа, включая Undo/Redo
+    void SetEditLog(EditLog* log);
+    EditLog* GetEditLog() const;
+    // Загружает пачку ячеек (пустой текст - удаление) без проверки на циклы.
+    // Предназначена для заведомо корректных данных, например из журнала;
+    // журнал отмены очищается. Формулы разбираются параллельно (см.
+    // ParseFormulas) до изменения листа, поэтому при синтаксической ошибке
+    // лист не изменяется.
+    void LoadCells(const std::vector<std::pair<Position, std::string>>& cells);
+    // Обходит непустые ячейки в произвольном порядке
+    void ForEachCell(const std::function<void(Position, const CellInterface&)>& action) const;
+
+    // Находит в столбцах непрерывные серии невычисленных формул, отличающихся
+    // только номером строки, и вычисляет каждую серию одним ядром.
+    void EvaluateColumnRuns() const;
+
+    // Серии короче этой длины вычисляются по одной ячейке
+    static const int MIN_COLUMN_RUN = 8;
+
+    // Общие подвыражения: одинаковые подвыражения разных формул листа
+    // (например, A1*B1 в =A1*B1+1 и =2/(A1*B1)) вычисляются один раз за
+    // пересчёт. Каждое становится скрытой ячейкой без позиции, которая
+    // кэширует значение и сбрасывается при изменении входов, как обычная
+    // формула; формулы читают её значение вместо вычисления подвыражения.
+    // Общими становятся подвыражения, встречающиеся хотя бы дважды, кроме
+    // ссылающихся на диапазоны и другие листы; из вложенных выбирается
+    // внешнее. Значения и тексты формул не меняются.
+    //
+    // Разметка строится по формулам на момент вызова и перестраивается
+    // заново при каждом вызове; формулы, заданные позже, её не используют.
+    // Вставка и удаление строк и столбцов снимают разметку. Возвращает число
+    // общих подвыражений.
+    size_t ShareCommonSubexpressions();
+    // Снимает разметку: формулы снова вычисляют подвыражения сами
+    void UnshareCommonSubexpressions();
+
 private:
+    struct EditDelta {
+        Position pos;
+        // nullptr - ячейки в позиции не было
+        std::unique_ptr<Cell> cell;
+    };
+    using EditBatch = std::vector<EditDelta>;
+
+    // Значение ячейки для индекса столбца: число, ошибка или ничего (пустая
+    // или текстовая ячейка)
+    using IndexValue = std::variant<std::monostate, double, FormulaError>;
+
+    // Индекс столбца для функций поиска и агрегатных функций: хеш-таблица
+    // значений для точного совпадения, упорядоченное дерево для
+    // приближённого поиска и агрегаты для сумм, минимумов и максимумов.
+    // Каждая структура строится при первом запросе своего вида. Индексируются
+    // только строки, попадавшие в запросы (covered): формула вне диапазона,
+    // например итог под столбцом, может сама зависеть от запроса. Изменённые
+    // строки копятся в stale и переиндексируются перед запросом, в диапазон
+    // которого попадают.
+    struct ColumnIndex {
+        // Проиндексированные числовые значения и строки с ошибками
+        std::unordered_map<int, double> values;
+        std::set<int> errors;
+        bool has_exact = false;
+        std::unordered_map<double, std::set<int>> exact;
+        bool has_sorted = false;
+        std::map<double, std::set<int>> sorted;
+        bool has_aggregates = false;
+        ColumnAggregates aggregates;
+        std::set<int> stale;
+        // Непересекающиеся отрезки проиндексированных строк: начало -> конец
+        std::map<int, int> covered;
+
+        void Update(int row, const IndexValue& value);
+        // Отрезки строк first_row..last_row, ещё не попадавшие в индекс
+        std::vector<std::pair<int, int>> GetUncovered(int first_row, int last_row) const;
+        void Cover(int first_row, int last_row);
+        size_t MemoryUsage() const;
+    };
+    IndexValue GetIndexValue(Position pos) const;
+    // Индекс столбца, в котором строки first_row..last_row проиндексированы и
+    // актуальны. Значения других строк не вычисляются. Ссылка действительна
+    // до следующего вычисления ячеек листа.
+    ColumnIndex& GetColumnIndex(int col, int first_row, int last_row) const;
+
+    // Ставит cell (nullptr - удаляет ячейку) в позицию pos, переносит
+    // зависимости и возвращает прежнюю ячейку
+    std::unique_ptr<Cell> SwapCell(Position pos, std::unique_ptr<Cell> cell);
+    void RecordEdit(Position pos, std::unique_ptr<Cell> old_cell);
+    // Закрывает текущую транзакцию: следующая правка начнёт новый пакет
+    void EndTransaction();
+    // Сбрасывает кэш зависимых от позиций batch_changes_
+    void FlushBatch();
+    void TrimJournal();
+    void ClearJournal();
+    void ApplyEdits(EditBatch& batch, bool reverse);
+    // Сдвигает ссылки на лист sheet в ячейках журнала отмены
+    void ShiftJournalReferences(std::string_view sheet, const std::function<Position(Position)>& shift);
+
+    std::unique_ptr<Cell> CreateCell(const std::string& text, Position pos, bool check_cycles = true);
+    std::unique_ptr<Cell> CreateCell(std::unique_ptr<FormulaInterface> formula, Position pos, bool check_cycles = true);
+    // Записывает в журнал текущее содержимое позиции
+    void LogEdit(Position pos);
+    // Регистрирует/удаляет ячейку в списках зависимых у ячеек, на которые она
+    // ссылается
+    void AddDependencies(Cell* cell);
+    void RemoveDependencies(Cell* cell);
+    // Добавляют/удаляют зависимую формулу у ячейки pos или, если ячейки нет,
+    // в таблице empty_dependents_
+    void AddDependent(Position pos, Cell* dependent);
+    void RemoveDependent(Position pos, Cell* dependent);
+    // Добавляет зависимую формулу диапазона, регистрируя новый диапазон в
+    // range_index_
+    void AddRangeDependent(const CellRange& range, Cell* dependent);
+    static std::uint32_t PackPosition(Position pos);
+    static Position UnpackPosition(std::uint32_t key);
+    // delta > 0 - вставка delta линий перед first, delta < 0 - удаление -delta
+    // линий, начиная с first
+    void ShiftCells(bool rows, int first, int delta);
+    // Рассылает накопленные изменения подписчикам этого и других листов книги,
+    // если не открыта транзакция
+    void PublishChanges();
+    void PublishOwnChanges();
+    int GetDependencyDepth(Position pos, std::unordered_map<Position, int, PositionHasher>& depths) const;
+
+    Sheet* ResolveSheet(std::string_view name);
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    bool profiling_ = false;
+    EditLog* log_ = nullptr;
+    size_t memory_budget_ = 0;
+    size_t edits_since_memory_check_ = 0;
+
+    std::deque<EditBatch> undo_;
+    std::vector<EditBatch> redo_;
+    size_t journal_size_ = 0;
+    size_t journal_limit_ = DEFAULT_JOURNAL_LIMIT;
+    int transaction_depth_ = 0;
+    // Последний пакет undo_ - открытая транзакция
+    bool transaction_open_ = false;
+    // Открытая транзакция не поместилась в журнал
+    bool journal_overflow_ = false;
+    int batch_depth_ = 0;
+    // Позиции, изменённые в открытой пачке (см. BeginBatch)
+    std::vector<Position> batch_changes_;
+
+    struct Subscription {
+        CellRange area;
+        ChangeCallback callback;
+    };
+    std::map<size_t, Subscription> subscriptions_;
+    size_t next_subscription_ = 0;
+    // Изменения с прошлой рассылки: отдельные позиции из обхода сброса кэша
+    // и целые области, сдвинутые вставкой или удалением. Копятся, только
+    // пока есть подписчики.
+    std::vector<Position> changed_cells_;
+    std::vector<CellRange> changed_areas_;
 
     std::unordered_map<Position, std::unique_ptr<CellInterface>,PositionHasher> sheet_ = {};
+    // Формулы, ссылающиеся на позиции без ячеек. Для таких позиций объекты
+    // Cell не создаются; при создании ячейки список переходит в неё.
+    std::unordered_map<std::uint32_t, std::vector<Cell*>> empty_dependents_;
+    // Формулы, ссылающиеся на диапазоны листа. Диапазоны, содержащие
+    // изменённую ячейку, ищутся по range_index_, в котором лежат ровно
+    // ключи range_dependents_.
+    std::map<CellRange, std::unordered_set<Cell*>> range_dependents_;
+    RangeIndex range_index_;
+    // Индексы столбцов по номеру столбца. Строятся лениво при вычислении
+    // формул листа, которое идёт в одном потоке.
+    mutable std::unordered_map<int, ColumnIndex> column_indexes_;
+    // Скрытые ячейки общих подвыражений по каноничному тексту. На них
+    // указывают формулы листа и ячейки в журнале отмены.
+    std::unordered_map<std::string, std::unique_ptr<Cell>> shared_cells_;
 
     void CheckValid(Position pos) const;
+    void CheckValid(const CellRange& range) const;
+    static void PrintValue(std::ostream& output, const CellInterface::Value& value);
+    // Печать позиций range в формате PrintValues (values) или PrintTexts
+    void PrintRows(std::ostream& output, const CellRange& range, bool values) const;
+    void ExportRows(std::ostream& output, const CellRange& area, bool values, size_t max_threads) const;
 };
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <sstream>
 #include <algorithm>
 #include <iostream>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -79,6 +80,103 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetPosition::ToString() const {
+    bool identifier = !sheet.empty() && !std::isdigit(static_cast<unsigned char>(sheet[0]))
+        && std::all_of(sheet.begin(), sheet.end(), [](char c) {
+               return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+           });
+    std::string result = identifier ? sheet : '\'' + sheet + '\'';
+    return result + '!' + pos.ToString();
+}
+
+bool CellRange::operator==(const CellRange& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::operator<(const CellRange& rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool CellRange::IsValid() const {
+    return first.IsValid() && last.IsValid();
+}
+
+bool CellRange::Contains(Position pos) const {
+    return IsValid() && first.row <= pos.row && pos.row <= last.row
+        && first.col <= pos.col && pos.col <= last.col;
+}
+
+std::string CellRange::ToString() const {
+    return first.ToString() + ':' + last.ToString();
+}
+
+void SheetInterface::ForEachCellInRange(const CellRange& range,
+                                        const std::function<void(Position, const CellInterface&)>& action) const {
+    if (!range.IsValid()) {
+        return;
+    }
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            if (auto cell = GetCell({row, col})) {
+                action({row, col}, *cell);
+            }
+        }
+    }
+}
+
+std::optional<int> SheetInterface::FindInColumn(int col, int first_row, int last_row, double key, bool exact) const {
+    std::optional<int> result;
+    std::optional<double> best;
+    for (int row = first_row; row <= last_row; ++row) {
+        auto cell = GetCell({row, col});
+        if (cell == nullptr) {
+            continue;
+        }
+        auto value = cell->GetValue();
+        if (!std::holds_alternative<double>(value)) {
+            continue;
+        }
+        double number = std::get<double>(value);
+        // пустая ячейка тоже имеет значение 0, но не участвует в поиске
+        if (number == 0.0 && cell->GetText().empty()) {
+            continue;
+        }
+        if (exact && number == key) {
+            return row;
+        }
+        if (!exact && number <= key && (!best || number >= *best)) {
+            best = number;
+            result = row;
+        }
+    }
+    return result;
+}
+
+RangeSummary SheetInterface::AggregateRange(const CellRange& range) const {
+    RangeSummary summary;
+    ForEachCellInRange(range, [&summary](Position, const CellInterface& cell) {
+        auto value = cell.GetValue();
+        if (std::holds_alternative<FormulaError>(value)) {
+            summary.error = std::get<FormulaError>(value);
+        } else if (std::holds_alternative<double>(value) && !cell.GetText().empty()) {
+            double number = std::get<double>(value);
+            summary.sum += number;
+            ++summary.count;
+            summary.min = std::min(summary.min, number);
+            summary.max = std::max(summary.max, number);
+        }
+    });
+    return summary;
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
\ No newline at end of file
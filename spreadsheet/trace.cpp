@@ -0,0 +1,124 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Trace {
+namespace {
+
+struct Span {
+    const char* name = nullptr;
+    Position pos = Position::NONE;
+    std::int64_t start_ns = 0;
+    std::int64_t end_ns = 0;
+};
+
+// Кольцевой буфер одного потока. Мьютекс захватывается владельцем на запись
+// и экспортом на чтение, поэтому на практике он не конкурентный.
+struct ThreadBuffer {
+    std::mutex mutex;
+    int tid = 0;
+    std::vector<Span> spans;
+    size_t next = 0;
+    bool wrapped = false;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    int next_tid = 1;
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+// Буфер регистрируется при первой записи потока и переживает сам поток,
+// чтобы его интервалы попали в экспорт.
+ThreadBuffer& GetThreadBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+        auto result = std::make_shared<ThreadBuffer>();
+        result->spans.resize(RING_CAPACITY);
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        result->tid = registry.next_tid++;
+        registry.buffers.push_back(result);
+        return result;
+    }();
+    return *buffer;
+}
+
+const std::chrono::steady_clock::time_point EPOCH = std::chrono::steady_clock::now();
+
+void PrintMicros(std::ostream& output, std::int64_t ns) {
+    output << ns / 1000 << '.' << static_cast<char>('0' + ns / 100 % 10)
+           << static_cast<char>('0' + ns / 10 % 10) << static_cast<char>('0' + ns % 10);
+}
+
+}  // namespace
+
+namespace Impl {
+
+std::int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - EPOCH).count();
+}
+
+void Record(const char* name, Position pos, std::int64_t start_ns, std::int64_t end_ns) {
+    ThreadBuffer& buffer = GetThreadBuffer();
+    std::lock_guard lock(buffer.mutex);
+    buffer.spans[buffer.next] = {name, pos, start_ns, end_ns};
+    if (++buffer.next == buffer.spans.size()) {
+        buffer.next = 0;
+        buffer.wrapped = true;
+    }
+}
+
+}  // namespace Impl
+
+void Enable(bool enabled) {
+    Impl::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Clear() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    for (const auto& buffer : registry.buffers) {
+        std::lock_guard buffer_lock(buffer->mutex);
+        buffer->next = 0;
+        buffer->wrapped = false;
+    }
+}
+
+void WriteChromeTrace(std::ostream& output) {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    output << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : registry.buffers) {
+        std::lock_guard buffer_lock(buffer->mutex);
+        size_t count = buffer->wrapped ? buffer->spans.size() : buffer->next;
+        size_t begin = buffer->wrapped ? buffer->next : 0;
+        for (size_t i = 0; i < count; ++i) {
+            const Span& span = buffer->spans[(begin + i) % buffer->spans.size()];
+            output << (first ? "\n" : ",\n");
+            first = false;
+            output << "{\"name\":\"" << span.name << "\",\"cat\":\"spreadsheet\",\"ph\":\"X\",\"ts\":";
+            PrintMicros(output, span.start_ns);
+            output << ",\"dur\":";
+            PrintMicros(output, std::max<std::int64_t>(span.end_ns - span.start_ns, 0));
+            output << ",\"pid\":1,\"tid\":" << buffer->tid;
+            if (span.pos.IsValid()) {
+                output << ",\"args\":{\"cell\":\"" << span.pos.ToString() << "\"}";
+            }
+            output << '}';
+        }
+    }
+    output << "\n]}\n";
+}
+
+}  // namespace Trace
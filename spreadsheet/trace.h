@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+// Трассировка времени выполнения в формате Chrome trace (chrome://tracing,
+// Perfetto). Каждый поток пишет интервалы в собственный кольцевой буфер, при
+// переполнении старые записи затираются. Пока трассировка выключена, TraceSpan
+// сводится к чтению одного флага.
+
+namespace Trace {
+
+// Ёмкость кольцевого буфера одного потока (в интервалах)
+inline constexpr size_t RING_CAPACITY = 1 << 16;
+
+namespace Impl {
+inline std::atomic<bool> enabled{false};
+
+std::int64_t NowNs();
+void Record(const char* name, Position pos, std::int64_t start_ns, std::int64_t end_ns);
+}  // namespace Impl
+
+inline bool IsEnabled() {
+    return Impl::enabled.load(std::memory_order_relaxed);
+}
+
+// Включает/выключает запись интервалов. Уже записанные интервалы сохраняются.
+void Enable(bool enabled);
+
+// Удаляет все записанные интервалы во всех потоках.
+void Clear();
+
+// Выводит записанные интервалы всех потоков в формате Chrome trace JSON.
+void WriteChromeTrace(std::ostream& output);
+
+// Интервал, охватывающий время жизни объекта. name должен быть строковым
+// литералом: сохраняется только указатель.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, Position pos = Position::NONE)
+        : name_(name)
+        , pos_(pos) {
+        if (IsEnabled()) {
+            start_ns_ = Impl::NowNs();
+        }
+    }
+
+    ~TraceSpan() {
+        if (start_ns_ >= 0) {
+            Impl::Record(name_, pos_, start_ns_, Impl::NowNs());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name_;
+    Position pos_;
+    std::int64_t start_ns_ = -1;
+};
+
+}  // namespace Trace
@@ -0,0 +1,154 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+Sheet& Workbook::AddSheet(const std::string& name) {
+    if (name.empty() || name.find_first_of("!'") != std::string::npos) {
+        throw std::invalid_argument("Invalid sheet name: " + name);
+    }
+    if (sheets_by_name_.count(name)) {
+        throw std::invalid_argument("Sheet already exists: " + name);
+    }
+    sheets_.push_back(std::make_unique<Sheet>(*this, name));
+    Sheet& sheet = *sheets_.back();
+    sheets_by_name_[name] = &sheet;
+    for (const auto& other : sheets_) {
+        other->LinkSheet(name);
+    }
+    return sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_by_name_.find(std::string(name));
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_by_name_.find(std::string(name));
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& sheet : sheets_) {
+        names.push_back(sheet->GetName());
+    }
+    return names;
+}
+
+bool Workbook::HasSubscriptions() const {
+    return subscription_count_ > 0;
+}
+
+void Workbook::Recalculate(size_t max_threads) {
+    const size_t n = sheets_.size();
+    std::unordered_map<const Sheet*, size_t> index;
+    for (size_t i = 0; i < n; ++i) {
+        index[sheets_[i].get()] = i;
+    }
+    std::vector<std::vector<size_t>> edges(n);
+    for (size_t i = 0; i < n; ++i) {
+        for (const auto& name : sheets_[i]->GetReferencedSheets()) {
+            if (const Sheet* target = GetSheet(name); target != nullptr && target != sheets_[i].get()) {
+                edges[i].push_back(index.at(target));
+            }
+        }
+    }
+
+    // Листы, ссылающиеся друг на друга, объединяются в компоненты сильной
+    // связности (алгоритм Тарьяна). Компоненты получаются в порядке, в котором
+    // каждая идёт после всех, от которых зависит.
+    std::vector<int> order(n, -1);
+    std::vector<int> low(n, 0);
+    std::vector<bool> on_stack(n, false);
+    std::vector<size_t> stack;
+    std::vector<size_t> component_of(n, 0);
+    std::vector<std::vector<size_t>> components;
+    int counter = 0;
+    std::function<void(size_t)> connect = [&](size_t v) {
+        order[v] = low[v] = counter++;
+        stack.push_back(v);
+        on_stack[v] = true;
+        for (size_t w : edges[v]) {
+            if (order[w] < 0) {
+                connect(w);
+                low[v] = std::min(low[v], low[w]);
+            } else if (on_stack[w]) {
+                low[v] = std::min(low[v], order[w]);
+            }
+        }
+        if (low[v] == order[v]) {
+            components.emplace_back();
+            size_t w;
+            do {
+                w = stack.back();
+                stack.pop_back();
+                on_stack[w] = false;
+                component_of[w] = components.size() - 1;
+                components.back().push_back(w);
+            } while (w != v);
+        }
+    };
+    for (size_t v = 0; v < n; ++v) {
+        if (order[v] < 0) {
+            connect(v);
+        }
+    }
+
+    std::vector<std::vector<size_t>> levels;
+    std::vector<size_t> level_of(components.size(), 0);
+    for (size_t c = 0; c < components.size(); ++c) {
+        for (size_t v : components[c]) {
+            for (size_t w : edges[v]) {
+                if (component_of[w] != c) {
+                    level_of[c] = std::max(level_of[c], level_of[component_of[w]] + 1);
+                }
+            }
+        }
+        if (levels.size() <= level_of[c]) {
+            levels.resize(level_of[c] + 1);
+        }
+        levels[level_of[c]].push_back(c);
+    }
+
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Листы предыдущих уровней к этому моменту полностью вычислены, поэтому
+    // потоки только читают их кэш
+    for (const auto& level : levels) {
+        std::atomic<size_t> next{0};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto worker = [&]() {
+            for (size_t k = next++; k < level.size(); k = next++) {
+                try {
+                    for (size_t v : components[level[k]]) {
+                        sheets_[v]->Recalculate();
+                    }
+                } catch (...) {
+                    std::lock_guard lock(error_mutex);
+                    error = std::current_exception();
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::min(max_threads, level.size()); ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
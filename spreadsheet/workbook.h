@@ -0,0 +1,45 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Книга из нескольких листов. Формулы могут ссылаться на ячейки других листов
+// (Sheet2!A1 или 'Лист 2'!A1): без апострофов записываются только имена из
+// латинских букв, цифр и '_', не начинающиеся с цифры. Зависимости между
+// ячейками хранятся общие для всей книги. Ссылка на лист, которого нет в
+// книге, вычисляется как #REF!.
+class Workbook {
+public:
+    // Добавляет пустой лист. Имя не может быть пустым, содержать '!' или
+    // апостроф и совпадать с именем существующего листа, иначе бросается
+    // std::invalid_argument.
+    Sheet& AddSheet(const std::string& name);
+
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имена листов в порядке добавления
+    std::vector<std::string> GetSheetNames() const;
+
+    // Вычисляет все формулы книги. Листы разбиваются на уровни по зависимостям
+    // между ними; листы одного уровня друг от друга не зависят и вычисляются
+    // параллельно. max_threads = 0 - по числу ядер.
+    void Recalculate(size_t max_threads = 0);
+
+    // Есть ли подписки (Sheet::Subscribe) хотя бы на одном листе
+    bool HasSubscriptions() const;
+
+private:
+    // Число подписок на всех листах ведёт Sheet: без подписок правки не
+    // обходят листы книги, чтобы разослать изменения
+    friend class Sheet;
+    size_t subscription_count_ = 0;
+
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string, Sheet*> sheets_by_name_;
+};